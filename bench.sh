@@ -0,0 +1,3 @@
+#!/bin/bash
+
+cmake --build build && ./build/luabinding_bench "$@"
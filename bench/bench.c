@@ -0,0 +1,890 @@
+/**
+ * @file bench.c
+ * @brief CLUA_DEF 接口函数单次调用开销测试
+ *
+ * 每个用例在lua循环中反复调用同一个接口, 分别测量 CLUA_DEF 生成的接口和手写的 lua_CFunction,
+ * 每个用例输出一行JSON: 平均每次调用耗时(ns)和内存分配次数.
+ * 批量用例对比lua中逐元素调用和 CLUA_DEF_BATCH 批量调用处理每个元素的开销,
+ * 方法用例对比 CLUA_CLASS 方法和基于 luaL_checkudata 的手写方法,
+ * ret_S ret_P 对比带缓存的返回值和每次创建字符串/userdata, out_d_2 为带输出参数的多返回值,
+ * 跳板用例轮流调用多个同签名的接口, 对比 CLUA_DEF 逐函数生成的接口和 CLUA_SIG 共享跳板.
+ * 错误用例在 pcall 中以错误类型的参数调用接口, 对比字符串错误, 错误对象和 luaL_checkinteger,
+ * 并检查先后保留的错误对象互不影响.
+ * 用例只测量耗时, 不统计指令缓存缺失: 计数依赖 perf 和硬件事件, 需要时在目标机器上用
+ * perf stat -e L1-icache-load-misses ./bench.sh 单独测量. 代码体积可直接用 size 比较目标文件
+ *
+ * 用法: luabinding_bench [循环次数]
+ */
+#include "luabinding.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+static size_t alloc_count = 0;
+
+static void* bench_alloc(void* ud, void* ptr, size_t osize, size_t nsize)
+{
+    (void)ud;
+    (void)osize;
+    if(nsize == 0)
+    {
+        free(ptr);
+        return NULL;
+    }
+    ++alloc_count;
+    return realloc(ptr, nsize);
+}
+
+static double now_ns(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (double)ts.tv_sec * 1e9 + (double)ts.tv_nsec;
+}
+
+/*******************
+ * 被绑定的C函数
+ ******************/
+static int bench_value = 0;
+
+static int ret_d_0(void)
+{
+    return bench_value;
+}
+static int ret_d_1(int a)
+{
+    return a;
+}
+static int ret_d_2(int a, int b)
+{
+    return a + b;
+}
+static int ret_d_3(int a, int b, int c)
+{
+    return a + b + c;
+}
+static int ret_d_4(int a, int b, int c, int d)
+{
+    return a + b + c + d;
+}
+static int ret_d_5(int a, int b, int c, int d, int e)
+{
+    return a + b + c + d + e;
+}
+static int ret_d_16(int a1, int a2, int a3, int a4, int a5, int a6, int a7, int a8, int a9, int a10,
+                    int a11, int a12, int a13, int a14, int a15, int a16)
+{
+    return a1 + a2 + a3 + a4 + a5 + a6 + a7 + a8 + a9 + a10 + a11 + a12 + a13 + a14 + a15 + a16;
+}
+static int out_d_2(int a, int b, int* rem)
+{
+    *rem = a % b;
+    return a / b;
+}
+
+static void void_d_0(void)
+{
+    ++bench_value;
+}
+static void void_d_1(int a)
+{
+    bench_value += a;
+}
+static void void_d_2(int a, int b)
+{
+    bench_value += a + b;
+}
+static void void_d_3(int a, int b, int c)
+{
+    bench_value += a + b + c;
+}
+static void void_d_4(int a, int b, int c, int d)
+{
+    bench_value += a + b + c + d;
+}
+static void void_d_5(int a, int b, int c, int d, int e)
+{
+    bench_value += a + b + c + d + e;
+}
+
+static unsigned ret_u(unsigned a)
+{
+    return a;
+}
+static float ret_f(float a)
+{
+    return a;
+}
+static long long ret_D(long long a)
+{
+    return a;
+}
+static unsigned long long ret_U(unsigned long long a)
+{
+    return a;
+}
+static double ret_F(double a)
+{
+    return a;
+}
+static const char* ret_s(const char* a)
+{
+    return a;
+}
+static void* ret_p(void* a)
+{
+    return a;
+}
+static const char* ret_S(int a)
+{
+    static const char* const names[] = { "idle", "running", "stopped", "unknown" };
+    return names[a & 3];
+}
+static void* ret_P(void* a)
+{
+    return a;
+}
+static clua_buffer ret_b(clua_buffer a)
+{
+    return a;
+}
+
+static void void_u(unsigned a)
+{
+    bench_value += (int)a;
+}
+static void void_f(float a)
+{
+    bench_value += (int)a;
+}
+static void void_D(long long a)
+{
+    bench_value += (int)a;
+}
+static void void_U(unsigned long long a)
+{
+    bench_value += (int)a;
+}
+static void void_F(double a)
+{
+    bench_value += (int)a;
+}
+static void void_s(const char* a)
+{
+    bench_value += a[0];
+}
+static void void_p(void* a)
+{
+    bench_value += a != NULL;
+}
+static void void_b(clua_buffer a)
+{
+    bench_value += (int)a.len;
+}
+
+CLUA_DEF(ret_d_0, "d", int)
+CLUA_DEF(ret_d_1, "dd", int, int)
+CLUA_DEF_BATCH(ret_d_2, "ddd", int, int, int)
+CLUA_DEF(ret_d_3, "dddd", int, int, int, int)
+CLUA_DEF(ret_d_4, "ddddd", int, int, int, int, int)
+CLUA_DEF(ret_d_5, "dddddd", int, int, int, int, int, int)
+CLUA_DEF(ret_d_16, "ddddddddddddddddd", int, int, int, int, int, int, int, int, int, int, int, int,
+         int, int, int, int, int)
+CLUA_DEF(out_d_2, "dddd", int, int, int, CLUA_OUT(int))
+CLUA_DEF(void_d_0, "v", VOID)
+CLUA_DEF(void_d_1, "vd", VOID, int)
+CLUA_DEF_BATCH(void_d_2, "vdd", VOID, int, int)
+CLUA_DEF(void_d_3, "vddd", VOID, int, int, int)
+CLUA_DEF(void_d_4, "vdddd", VOID, int, int, int, int)
+CLUA_DEF(void_d_5, "vddddd", VOID, int, int, int, int, int)
+CLUA_DEF(ret_u, "uu", unsigned, unsigned)
+CLUA_DEF(ret_f, "ff", float, float)
+CLUA_DEF(ret_D, "DD", long long, long long)
+CLUA_DEF(ret_U, "UU", unsigned long long, unsigned long long)
+CLUA_DEF(ret_F, "FF", double, double)
+CLUA_DEF(ret_s, "ss", const char*, const char*)
+CLUA_DEF(ret_p, "pp", void*, void*)
+CLUA_DEF(ret_b, "bb", clua_buffer, clua_buffer)
+CLUA_DEF(ret_S, "Sd", const char*, int)
+CLUA_DEF(ret_P, "PP", void*, void*)
+CLUA_DEF(void_u, "vu", VOID, unsigned)
+CLUA_DEF(void_f, "vf", VOID, float)
+CLUA_DEF(void_D, "vD", VOID, long long)
+CLUA_DEF(void_U, "vU", VOID, unsigned long long)
+CLUA_DEF(void_F, "vF", VOID, double)
+CLUA_DEF(void_s, "vs", VOID, const char*)
+CLUA_DEF(void_p, "vp", VOID, void*)
+CLUA_DEF(void_b, "vb", VOID, clua_buffer)
+
+typedef struct counter
+{
+    int value;
+} counter;
+
+static void counter_free(counter* c)
+{
+    free(c);
+}
+static int counter_add(counter* c, int n)
+{
+    return c->value += n;
+}
+
+CLUA_CLASS(counter, counter_free)
+
+#undef CLUA_CLASSES
+#define CLUA_CLASSES(X) X(counter)
+
+CLUA_DEF(counter_add, "dOd", int, counter*, int)
+
+/**
+ * @brief 同签名的一组C函数, 分别用 CLUA_DEF 和 CLUA_SIG 跳板绑定
+ */
+#define SIG_FUNCS(X)                                                                               \
+    X(0) X(1) X(2) X(3) X(4) X(5) X(6) X(7) X(8) X(9) X(10) X(11) X(12) X(13) X(14) X(15)
+
+#define SIG_FUNC(n)                                                                                \
+    static int sig_##n(int a, int b)                                                               \
+    {                                                                                              \
+        return a + b + n;                                                                          \
+    }                                                                                              \
+    CLUA_DEF(sig_##n, "ddd", int, int, int)                                                        \
+    CLUA_DEF_SIG(sig_##n, ddd)
+
+CLUA_SIG(ddd, "ddd", int, int, int)
+SIG_FUNCS(SIG_FUNC)
+
+/*******************
+ * 手写的对照接口
+ ******************/
+#define ARG_D(i) ((int)luaL_checkinteger(L, i))
+
+static int base_ret_d_0(lua_State* L)
+{
+    lua_pushnumber(L, ret_d_0());
+    return 1;
+}
+static int base_ret_d_1(lua_State* L)
+{
+    lua_pushnumber(L, ret_d_1(ARG_D(1)));
+    return 1;
+}
+static int base_ret_d_2(lua_State* L)
+{
+    lua_pushnumber(L, ret_d_2(ARG_D(1), ARG_D(2)));
+    return 1;
+}
+static int base_ret_d_3(lua_State* L)
+{
+    lua_pushnumber(L, ret_d_3(ARG_D(1), ARG_D(2), ARG_D(3)));
+    return 1;
+}
+static int base_ret_d_4(lua_State* L)
+{
+    lua_pushnumber(L, ret_d_4(ARG_D(1), ARG_D(2), ARG_D(3), ARG_D(4)));
+    return 1;
+}
+static int base_ret_d_5(lua_State* L)
+{
+    lua_pushnumber(L, ret_d_5(ARG_D(1), ARG_D(2), ARG_D(3), ARG_D(4), ARG_D(5)));
+    return 1;
+}
+
+static int base_ret_d_16(lua_State* L)
+{
+    lua_pushnumber(L, ret_d_16(ARG_D(1), ARG_D(2), ARG_D(3), ARG_D(4), ARG_D(5), ARG_D(6), ARG_D(7),
+                               ARG_D(8), ARG_D(9), ARG_D(10), ARG_D(11), ARG_D(12), ARG_D(13),
+                               ARG_D(14), ARG_D(15), ARG_D(16)));
+    return 1;
+}
+static int base_out_d_2(lua_State* L)
+{
+    int rem;
+    lua_pushnumber(L, out_d_2(ARG_D(1), ARG_D(2), &rem));
+    lua_pushnumber(L, rem);
+    return 2;
+}
+
+static int base_void_d_0(lua_State* L)
+{
+    (void)L;
+    void_d_0();
+    return 0;
+}
+static int base_void_d_1(lua_State* L)
+{
+    void_d_1(ARG_D(1));
+    return 0;
+}
+static int base_void_d_2(lua_State* L)
+{
+    void_d_2(ARG_D(1), ARG_D(2));
+    return 0;
+}
+static int base_void_d_3(lua_State* L)
+{
+    void_d_3(ARG_D(1), ARG_D(2), ARG_D(3));
+    return 0;
+}
+static int base_void_d_4(lua_State* L)
+{
+    void_d_4(ARG_D(1), ARG_D(2), ARG_D(3), ARG_D(4));
+    return 0;
+}
+static int base_void_d_5(lua_State* L)
+{
+    void_d_5(ARG_D(1), ARG_D(2), ARG_D(3), ARG_D(4), ARG_D(5));
+    return 0;
+}
+
+static int base_ret_u(lua_State* L)
+{
+    lua_pushnumber(L, ret_u((unsigned)luaL_checkinteger(L, 1)));
+    return 1;
+}
+static int base_ret_f(lua_State* L)
+{
+    lua_pushnumber(L, ret_f((float)luaL_checknumber(L, 1)));
+    return 1;
+}
+static int base_ret_D(lua_State* L)
+{
+    lua_pushnumber(L, (lua_Number)ret_D(luaL_checkinteger(L, 1)));
+    return 1;
+}
+static int base_ret_U(lua_State* L)
+{
+    lua_pushnumber(L, (lua_Number)ret_U((unsigned long long)luaL_checkinteger(L, 1)));
+    return 1;
+}
+static int base_ret_F(lua_State* L)
+{
+    lua_pushnumber(L, ret_F(luaL_checknumber(L, 1)));
+    return 1;
+}
+static int base_ret_s(lua_State* L)
+{
+    lua_pushstring(L, ret_s(luaL_checkstring(L, 1)));
+    return 1;
+}
+static int base_ret_p(lua_State* L)
+{
+    luaL_checktype(L, 1, LUA_TLIGHTUSERDATA);
+    lua_pushlightuserdata(L, ret_p(lua_touserdata(L, 1)));
+    return 1;
+}
+static int base_ret_S(lua_State* L)
+{
+    lua_pushstring(L, ret_S(ARG_D(1)));
+    return 1;
+}
+/**
+ * @brief 每次返回都创建新的userdata, 对照 'P' 的缓存
+ */
+static int base_ret_P(lua_State* L)
+{
+    luaL_checktype(L, 1, LUA_TLIGHTUSERDATA);
+    *(void**)lua_newuserdata(L, sizeof(void*)) = ret_P(lua_touserdata(L, 1));
+    return 1;
+}
+static int base_ret_b(lua_State* L)
+{
+    clua_buffer a;
+    a.data = luaL_checklstring(L, 1, &a.len);
+    a = ret_b(a);
+    lua_pushlstring(L, a.data, a.len);
+    return 1;
+}
+
+static int base_void_u(lua_State* L)
+{
+    void_u((unsigned)luaL_checkinteger(L, 1));
+    return 0;
+}
+static int base_void_f(lua_State* L)
+{
+    void_f((float)luaL_checknumber(L, 1));
+    return 0;
+}
+static int base_void_D(lua_State* L)
+{
+    void_D(luaL_checkinteger(L, 1));
+    return 0;
+}
+static int base_void_U(lua_State* L)
+{
+    void_U((unsigned long long)luaL_checkinteger(L, 1));
+    return 0;
+}
+static int base_void_F(lua_State* L)
+{
+    void_F(luaL_checknumber(L, 1));
+    return 0;
+}
+static int base_void_s(lua_State* L)
+{
+    void_s(luaL_checkstring(L, 1));
+    return 0;
+}
+static int base_void_p(lua_State* L)
+{
+    luaL_checktype(L, 1, LUA_TLIGHTUSERDATA);
+    void_p(lua_touserdata(L, 1));
+    return 0;
+}
+static int base_void_b(lua_State* L)
+{
+    clua_buffer a;
+    a.data = luaL_checklstring(L, 1, &a.len);
+    void_b(a);
+    return 0;
+}
+
+/*******************
+ * 用例
+ ******************/
+typedef struct bench_case
+{
+    const char* name;
+    lua_CFunction clua;
+    lua_CFunction base;
+    const char* args; ///< lua调用参数, 可使用局部变量 p(light userdata)
+} bench_case;
+
+#define BENCH_CASE(f, args) { #f, CLUA_FNAME(f), base_##f, args }
+
+static const bench_case bench_cases[] = {
+    BENCH_CASE(ret_d_0, ""),
+    BENCH_CASE(ret_d_1, "1"),
+    BENCH_CASE(ret_d_2, "1, 2"),
+    BENCH_CASE(ret_d_3, "1, 2, 3"),
+    BENCH_CASE(ret_d_4, "1, 2, 3, 4"),
+    BENCH_CASE(ret_d_5, "1, 2, 3, 4, 5"),
+    BENCH_CASE(ret_d_16, "1, 2, 3, 4, 5, 6, 7, 8, 9, 10, 11, 12, 13, 14, 15, 16"),
+    BENCH_CASE(out_d_2, "7, 2"),
+    BENCH_CASE(void_d_0, ""),
+    BENCH_CASE(void_d_1, "1"),
+    BENCH_CASE(void_d_2, "1, 2"),
+    BENCH_CASE(void_d_3, "1, 2, 3"),
+    BENCH_CASE(void_d_4, "1, 2, 3, 4"),
+    BENCH_CASE(void_d_5, "1, 2, 3, 4, 5"),
+    BENCH_CASE(ret_u, "1"),
+    BENCH_CASE(ret_f, "1.5"),
+    BENCH_CASE(ret_D, "1"),
+    BENCH_CASE(ret_U, "1"),
+    BENCH_CASE(ret_F, "1.5"),
+    BENCH_CASE(ret_s, "\"abc\""),
+    BENCH_CASE(ret_p, "p"),
+    BENCH_CASE(ret_b, "\"a\\0c\""),
+    BENCH_CASE(ret_S, "i"),
+    BENCH_CASE(ret_P, "p"),
+    BENCH_CASE(void_u, "1"),
+    BENCH_CASE(void_f, "1.5"),
+    BENCH_CASE(void_D, "1"),
+    BENCH_CASE(void_U, "1"),
+    BENCH_CASE(void_F, "1.5"),
+    BENCH_CASE(void_s, "\"abc\""),
+    BENCH_CASE(void_p, "p"),
+    BENCH_CASE(void_b, "\"a\\0c\""),
+};
+
+typedef struct bench_result
+{
+    double ns_per_call;
+    double allocs_per_call;
+    int ok; ///< lua循环是否正常结束, 出错的用例不输出结果
+} bench_result;
+
+/**
+ * @brief 在lua循环中调用 fn 共 iters 次
+ * @note 栈顶为已编译的循环chunk
+ */
+static bench_result run_loop(lua_State* L, lua_CFunction fn, long iters)
+{
+    bench_result result = { 0, 0, 0 };
+    lua_pushvalue(L, -1);
+    lua_pushcfunction(L, fn);
+    lua_pushnumber(L, (lua_Number)iters);
+    lua_pushlightuserdata(L, &bench_value);
+
+    size_t allocs = alloc_count;
+    double start = now_ns();
+    if(lua_pcall(L, 3, 0, 0) != 0)
+    {
+        fprintf(stderr, "bench error: %s\n", lua_tostring(L, -1));
+        lua_pop(L, 1);
+        return result;
+    }
+    result.ns_per_call = (now_ns() - start) / (double)iters;
+    result.allocs_per_call = (double)(alloc_count - allocs) / (double)iters;
+    result.ok = 1;
+    return result;
+}
+
+static int run_case(lua_State* L, const bench_case* c, long iters)
+{
+    char code[256];
+    snprintf(code, sizeof(code), "local f, n, p = ...\nfor i = 1, n do f(%s) end", c->args);
+    if(luaL_loadbuffer(L, code, strlen(code), c->name) != 0)
+    {
+        fprintf(stderr, "bench error: %s\n", lua_tostring(L, -1));
+        lua_pop(L, 1);
+        return 0;
+    }
+
+    /* 预热 */
+    run_loop(L, c->clua, iters / 10 + 1);
+    run_loop(L, c->base, iters / 10 + 1);
+
+    bench_result clua = run_loop(L, c->clua, iters);
+    bench_result base = run_loop(L, c->base, iters);
+    lua_pop(L, 1);
+    if(!clua.ok || !base.ok)
+        return 0;
+
+    printf("{\"case\":\"%s\",\"iters\":%ld,\"clua_ns_per_call\":%.3f,\"base_ns_per_call\":%.3f,"
+           "\"clua_allocs_per_call\":%.4f,\"base_allocs_per_call\":%.4f}\n",
+           c->name, iters, clua.ns_per_call, base.ns_per_call, clua.allocs_per_call,
+           base.allocs_per_call);
+    return 1;
+}
+
+typedef struct batch_case
+{
+    const char* name;
+    lua_CFunction clua;
+    lua_CFunction batch;
+} batch_case;
+
+#define BATCH_CASE(f) { #f, CLUA_FNAME(f), CLUA_BATCH_FNAME(f) }
+
+static const batch_case batch_cases[] = {
+    BATCH_CASE(ret_d_2),
+    BATCH_CASE(void_d_2),
+};
+
+static const char batch_loop[] = "local f, n, a, b, batch = ...\n"
+                                 "if batch then\n"
+                                 "  for i = 1, n do f(a, b) end\n"
+                                 "else\n"
+                                 "  local m = #a\n"
+                                 "  for i = 1, n do\n"
+                                 "    local r = {}\n"
+                                 "    for j = 1, m do r[j] = f(a[j], b[j]) end\n"
+                                 "  end\n"
+                                 "end";
+
+static bench_result run_batch_loop(lua_State* L, lua_CFunction fn, long iters, int elems, int batch)
+{
+    bench_result result = { 0, 0, 0 };
+    lua_pushvalue(L, -3);
+    lua_pushcfunction(L, fn);
+    lua_pushnumber(L, (lua_Number)iters);
+    lua_pushvalue(L, -5);
+    lua_pushvalue(L, -5);
+    lua_pushboolean(L, batch);
+
+    size_t allocs = alloc_count;
+    double start = now_ns();
+    if(lua_pcall(L, 5, 0, 0) != 0)
+    {
+        fprintf(stderr, "bench error: %s\n", lua_tostring(L, -1));
+        lua_pop(L, 1);
+        return result;
+    }
+    double total = (double)iters * elems;
+    result.ns_per_call = (now_ns() - start) / total;
+    result.allocs_per_call = (double)(alloc_count - allocs) / total;
+    result.ok = 1;
+    return result;
+}
+
+static int run_batch_case(lua_State* L, const batch_case* c, long iters, int elems)
+{
+    if(luaL_loadbuffer(L, batch_loop, strlen(batch_loop), c->name) != 0)
+    {
+        fprintf(stderr, "bench error: %s\n", lua_tostring(L, -1));
+        lua_pop(L, 1);
+        return 0;
+    }
+    for(int t = 0; t < 2; ++t)
+    {
+        lua_createtable(L, elems, 0);
+        for(int i = 1; i <= elems; ++i)
+        {
+            lua_pushnumber(L, i);
+            lua_rawseti(L, -2, i);
+        }
+    }
+
+    long rounds = iters / elems + 1;
+    run_batch_loop(L, c->clua, rounds / 10 + 1, elems, 0);
+    run_batch_loop(L, c->batch, rounds / 10 + 1, elems, 1);
+
+    bench_result loop = run_batch_loop(L, c->clua, rounds, elems, 0);
+    bench_result batch = run_batch_loop(L, c->batch, rounds, elems, 1);
+    lua_pop(L, 3);
+    if(!loop.ok || !batch.ok)
+        return 0;
+
+    printf("{\"case\":\"batch_%s\",\"elems\":%d,\"rounds\":%ld,\"loop_ns_per_elem\":%.3f,"
+           "\"batch_ns_per_elem\":%.3f,\"loop_allocs_per_elem\":%.4f,"
+           "\"batch_allocs_per_elem\":%.4f}\n",
+           c->name, elems, rounds, loop.ns_per_call, batch.ns_per_call, loop.allocs_per_call,
+           batch.allocs_per_call);
+    return 1;
+}
+
+/*******************
+ * 对象方法
+ ******************/
+static int base_counter_add(lua_State* L)
+{
+    counter** c = (counter**)luaL_checkudata(L, 1, "counter");
+    lua_pushnumber(L, counter_add(*c, ARG_D(2)));
+    return 1;
+}
+
+static int base_counter_gc(lua_State* L)
+{
+    counter_free(*(counter**)lua_touserdata(L, 1));
+    return 0;
+}
+
+static const char method_loop[] = "local c, n = ...\nfor i = 1, n do c:add(1) end";
+
+/**
+ * @brief 对比 CLUA_CLASS 方法和使用 luaL_checkudata 的手写方法
+ * @note 栈顶为已编译的循环chunk
+ */
+static bench_result run_method_loop(lua_State* L, int clua, long iters)
+{
+    bench_result result = { 0, 0, 0 };
+    lua_pushvalue(L, -1);
+    counter* c = (counter*)calloc(1, sizeof(counter));
+    if(clua)
+    {
+        lua_new_object(L, &CLUA_CLASS_DESC(counter), c);
+    }
+    else
+    {
+        *(counter**)lua_newuserdata(L, sizeof(counter*)) = c;
+        luaL_getmetatable(L, "counter");
+        lua_setmetatable(L, -2);
+    }
+    lua_pushnumber(L, (lua_Number)iters);
+
+    size_t allocs = alloc_count;
+    double start = now_ns();
+    if(lua_pcall(L, 2, 0, 0) != 0)
+    {
+        fprintf(stderr, "bench error: %s\n", lua_tostring(L, -1));
+        lua_pop(L, 1);
+        return result;
+    }
+    result.ns_per_call = (now_ns() - start) / (double)iters;
+    result.allocs_per_call = (double)(alloc_count - allocs) / (double)iters;
+    result.ok = 1;
+    return result;
+}
+
+static int run_method_case(lua_State* L, long iters)
+{
+    static const luaL_Reg methods[] = { CLUA_METHOD(add, counter_add), { NULL, NULL } };
+    lua_register_class(L, &CLUA_CLASS_DESC(counter), methods);
+    lua_pop(L, 1);
+
+    luaL_newmetatable(L, "counter");
+    lua_newtable(L);
+    lua_pushcfunction(L, base_counter_add);
+    lua_setfield(L, -2, "add");
+    lua_setfield(L, -2, "__index");
+    lua_pushcfunction(L, base_counter_gc);
+    lua_setfield(L, -2, "__gc");
+    lua_pop(L, 1);
+
+    if(luaL_loadbuffer(L, method_loop, strlen(method_loop), "method") != 0)
+    {
+        fprintf(stderr, "bench error: %s\n", lua_tostring(L, -1));
+        lua_pop(L, 1);
+        return 0;
+    }
+    run_method_loop(L, 1, iters / 10 + 1);
+    run_method_loop(L, 0, iters / 10 + 1);
+
+    bench_result clua = run_method_loop(L, 1, iters);
+    bench_result base = run_method_loop(L, 0, iters);
+    lua_pop(L, 1);
+    if(!clua.ok || !base.ok)
+        return 0;
+
+    printf("{\"case\":\"method_d_1\",\"iters\":%ld,\"clua_ns_per_call\":%.3f,"
+           "\"base_ns_per_call\":%.3f,\"clua_allocs_per_call\":%.4f,"
+           "\"base_allocs_per_call\":%.4f}\n",
+           iters, clua.ns_per_call, base.ns_per_call, clua.allocs_per_call, base.allocs_per_call);
+    return 1;
+}
+
+/*******************
+ * 共享跳板
+ ******************/
+static const char sig_loop[] = "local lib, n = ...\n"
+                               "local fs = {}\n"
+                               "for _, f in pairs(lib) do fs[#fs + 1] = f end\n"
+                               "local m = #fs\n"
+                               "for i = 1, n do fs[i % m + 1](i, 1) end";
+
+/**
+ * @brief 轮流调用 SIG_FUNCS 中的函数
+ * @note 栈顶为已编译的循环chunk
+ */
+static bench_result run_sig_loop(lua_State* L, const clua_reg* regs, long iters)
+{
+    bench_result result = { 0, 0, 0 };
+    lua_pushvalue(L, -1);
+    lua_newtable(L);
+    lua_register_funcs(L, regs);
+    lua_pushnumber(L, (lua_Number)iters);
+
+    size_t allocs = alloc_count;
+    double start = now_ns();
+    if(lua_pcall(L, 2, 0, 0) != 0)
+    {
+        fprintf(stderr, "bench error: %s\n", lua_tostring(L, -1));
+        lua_pop(L, 1);
+        return result;
+    }
+    result.ns_per_call = (now_ns() - start) / (double)iters;
+    result.allocs_per_call = (double)(alloc_count - allocs) / (double)iters;
+    result.ok = 1;
+    return result;
+}
+
+static int run_sig_case(lua_State* L, long iters)
+{
+#define SIG_REG(n) CLUA_REG(sig_##n),
+#define SIG_REG_SIG(n) CLUA_REG_SIG(sig_##n, ddd),
+    static const clua_reg def_regs[] = { SIG_FUNCS(SIG_REG) { NULL, NULL, NULL } };
+    static const clua_reg sig_regs[] = { SIG_FUNCS(SIG_REG_SIG) { NULL, NULL, NULL } };
+#undef SIG_REG
+#undef SIG_REG_SIG
+
+    if(luaL_loadbuffer(L, sig_loop, strlen(sig_loop), "sig") != 0)
+    {
+        fprintf(stderr, "bench error: %s\n", lua_tostring(L, -1));
+        lua_pop(L, 1);
+        return 0;
+    }
+    run_sig_loop(L, def_regs, iters / 10 + 1);
+    run_sig_loop(L, sig_regs, iters / 10 + 1);
+
+    bench_result def = run_sig_loop(L, def_regs, iters);
+    bench_result sig = run_sig_loop(L, sig_regs, iters);
+    lua_pop(L, 1);
+    if(!def.ok || !sig.ok)
+        return 0;
+
+    printf("{\"case\":\"sig_d_2\",\"funcs\":%d,\"iters\":%ld,\"def_ns_per_call\":%.3f,"
+           "\"sig_ns_per_call\":%.3f,\"def_allocs_per_call\":%.4f,\"sig_allocs_per_call\":%.4f}\n",
+           (int)(sizeof(def_regs) / sizeof(def_regs[0])) - 1, iters, def.ns_per_call,
+           sig.ns_per_call, def.allocs_per_call, sig.allocs_per_call);
+    return 1;
+}
+
+/*******************
+ * 参数类型错误
+ ******************/
+static const char error_loop[] = "local f, n = ...\n"
+                                 "local pcall = pcall\n"
+                                 "for i = 1, n do pcall(f, \"x\") end";
+
+/* 先后保留的两个错误对象必须相互独立, 不能被之后的错误改写 */
+static const char error_check[] = "local f = ...\n"
+                                  "local _, e1 = pcall(f, \"x\")\n"
+                                  "local _, e2 = pcall(f, {})\n"
+                                  "assert(not rawequal(e1, e2), \"clua_error is shared\")\n"
+                                  "assert(e1.actual == \"string\" and e2.actual == \"table\",\n"
+                                  "       \"retained clua_error was overwritten\")";
+
+static int check_error_objects(lua_State* L)
+{
+    if(luaL_loadbuffer(L, error_check, strlen(error_check), "error_check") != 0)
+    {
+        fprintf(stderr, "bench error: %s\n", lua_tostring(L, -1));
+        lua_pop(L, 1);
+        return 0;
+    }
+    lua_pushcfunction(L, CLUA_FNAME(ret_d_1));
+    if(lua_pcall(L, 1, 0, 0) != 0)
+    {
+        fprintf(stderr, "bench error: %s\n", lua_tostring(L, -1));
+        lua_pop(L, 1);
+        return 0;
+    }
+    return 1;
+}
+
+static int run_error_case(lua_State* L, long iters)
+{
+    if(luaL_loadbuffer(L, error_loop, strlen(error_loop), "error") != 0)
+    {
+        fprintf(stderr, "bench error: %s\n", lua_tostring(L, -1));
+        lua_pop(L, 1);
+        return 0;
+    }
+    /* 字符串错误每次都生成调用栈, 循环次数减少 */
+    iters = iters / 100 + 1;
+    run_loop(L, CLUA_FNAME(ret_d_1), iters / 10 + 1);
+    bench_result str = run_loop(L, CLUA_FNAME(ret_d_1), iters);
+    lua_set_error_mode(L, CLUA_ERROR_OBJECT);
+    run_loop(L, CLUA_FNAME(ret_d_1), iters / 10 + 1);
+    bench_result obj = run_loop(L, CLUA_FNAME(ret_d_1), iters);
+    int distinct = check_error_objects(L);
+    lua_set_error_mode(L, CLUA_ERROR_STRING);
+    run_loop(L, base_ret_d_1, iters / 10 + 1);
+    bench_result base = run_loop(L, base_ret_d_1, iters);
+    lua_pop(L, 1);
+    if(!str.ok || !obj.ok || !base.ok || !distinct)
+        return 0;
+
+    printf("{\"case\":\"error_d_1\",\"iters\":%ld,\"string_ns_per_call\":%.3f,"
+           "\"object_ns_per_call\":%.3f,\"base_ns_per_call\":%.3f,"
+           "\"string_allocs_per_call\":%.4f,\"object_allocs_per_call\":%.4f,"
+           "\"base_allocs_per_call\":%.4f}\n",
+           iters, str.ns_per_call, obj.ns_per_call, base.ns_per_call, str.allocs_per_call,
+           obj.allocs_per_call, base.allocs_per_call);
+    return 1;
+}
+
+int main(int argc, char* argv[])
+{
+    long iters = argc > 1 ? atol(argv[1]) : 10000000;
+    if(iters <= 0)
+    {
+        fprintf(stderr, "usage: %s [iterations]\n", argv[0]);
+        return 1;
+    }
+
+    lua_State* L = lua_newstate(bench_alloc, NULL);
+    luaL_openlibs(L);
+    /* 'S' 'P' 等返回值依赖 luaopen_clua 创建的元表和缓存, 与实际使用时一致 */
+    luaopen_clua(L);
+    lua_pop(L, 1);
+
+    int ok = 1;
+    for(size_t i = 0; i < sizeof(bench_cases) / sizeof(bench_cases[0]); ++i)
+    {
+        ok &= run_case(L, &bench_cases[i], iters);
+    }
+    for(size_t i = 0; i < sizeof(batch_cases) / sizeof(batch_cases[0]); ++i)
+    {
+        ok &= run_batch_case(L, &batch_cases[i], iters, 1000);
+    }
+    ok &= run_method_case(L, iters);
+    ok &= run_sig_case(L, iters);
+    ok &= run_error_case(L, iters);
+    lua_close(L);
+
+    return ok ? 0 : 1;
+}
@@ -0,0 +1,268 @@
+#include "clua_alloc.h"
+#include <stdio.h>
+#include <stdlib.h>
+
+#define SMALL_STEP 16
+#define SMALL_CLASSES (CLUA_ALLOC_SMALL_MAX / SMALL_STEP)
+#define CHUNK_SIZE (64 * 1024)
+
+#define ROUND_UP(size) (((size) + SMALL_STEP - 1) & ~(size_t)(SMALL_STEP - 1))
+#define SIZE_CLASS(size) (((size) - 1) / SMALL_STEP)
+
+typedef struct free_block
+{
+    struct free_block* next;
+} free_block;
+
+/**
+ * @brief 切分用的大块内存, 从 data 开始按 used 顺序切分
+ */
+typedef struct chunk
+{
+    struct chunk* next;
+    size_t size;
+    size_t used;
+    max_align_t data[];
+} chunk;
+
+struct clua_alloc
+{
+    free_block* free[SMALL_CLASSES];
+    chunk* chunks; ///< 链表头为当前切分的块
+    int arena;
+    size_t limit;
+    size_t bytes;
+    size_t peak;
+    size_t blocks;
+    size_t allocs;
+    size_t failed;
+    size_t reserved;
+};
+
+static chunk* chunk_new(clua_alloc* a, size_t size)
+{
+    chunk* c = (chunk*)malloc(sizeof(chunk) + size);
+    if(c == NULL)
+        return NULL;
+    c->size = size;
+    c->used = 0;
+    a->reserved += size;
+    return c;
+}
+
+/**
+ * @brief 从当前块切分, size 必须是 SMALL_STEP 的倍数
+ */
+static void* chunk_alloc(clua_alloc* a, size_t size)
+{
+    chunk* c = a->chunks;
+    if(c == NULL || c->size - c->used < size)
+    {
+        c = chunk_new(a, size > CHUNK_SIZE ? size : CHUNK_SIZE);
+        if(c == NULL)
+            return NULL;
+        if(c->size > CHUNK_SIZE && a->chunks != NULL)
+        {
+            /* 独占的超大块放在当前块之后, 当前块剩余的空间继续切分 */
+            c->next = a->chunks->next;
+            a->chunks->next = c;
+        }
+        else
+        {
+            c->next = a->chunks;
+            a->chunks = c;
+        }
+    }
+    void* p = (char*)c->data + c->used;
+    c->used += size;
+    return p;
+}
+
+static void* block_alloc(clua_alloc* a, size_t size)
+{
+    if(size <= CLUA_ALLOC_SMALL_MAX)
+    {
+        free_block** head = &a->free[SIZE_CLASS(size)];
+        free_block* b = *head;
+        if(b != NULL)
+        {
+            *head = b->next;
+            return b;
+        }
+        return chunk_alloc(a, ROUND_UP(size));
+    }
+    return a->arena ? chunk_alloc(a, ROUND_UP(size)) : malloc(size);
+}
+
+static void block_free(clua_alloc* a, void* ptr, size_t size)
+{
+    if(size <= CLUA_ALLOC_SMALL_MAX)
+    {
+        free_block** head = &a->free[SIZE_CLASS(size)];
+        free_block* b = (free_block*)ptr;
+        b->next = *head;
+        *head = b;
+    }
+    else if(!a->arena)
+    {
+        free(ptr);
+    }
+}
+
+static void* block_realloc(clua_alloc* a, void* ptr, size_t osize, size_t nsize)
+{
+    if(osize <= CLUA_ALLOC_SMALL_MAX && nsize <= CLUA_ALLOC_SMALL_MAX &&
+       SIZE_CLASS(osize) == SIZE_CLASS(nsize))
+        return ptr;
+
+    if(osize > CLUA_ALLOC_SMALL_MAX && nsize > CLUA_ALLOC_SMALL_MAX)
+    {
+        if(!a->arena)
+        {
+            void* p = realloc(ptr, nsize);
+            return p != NULL || nsize > osize ? p : ptr;
+        }
+        if(nsize <= ROUND_UP(osize))
+            return ptr;
+        /* 当前块最后切出的块直接原地扩展 */
+        chunk* c = a->chunks;
+        size_t grow = ROUND_UP(nsize) - ROUND_UP(osize);
+        if((char*)ptr + ROUND_UP(osize) == (char*)c->data + c->used && c->size - c->used >= grow)
+        {
+            c->used += grow;
+            return ptr;
+        }
+    }
+
+    void* p = block_alloc(a, nsize);
+    if(p == NULL)
+    {
+        /* lua要求缩小不能失败, 此时保留原块, 原块之后按较小的尺寸释放, 只浪费部分空间 */
+        return nsize < osize ? ptr : NULL;
+    }
+    memcpy(p, ptr, osize < nsize ? osize : nsize);
+    block_free(a, ptr, osize);
+    return p;
+}
+
+void* clua_alloc_fn(void* ud, void* ptr, size_t osize, size_t nsize)
+{
+    clua_alloc* a = (clua_alloc*)ud;
+    if(ptr == NULL)
+        osize = 0;
+
+    if(nsize == 0)
+    {
+        if(ptr != NULL)
+        {
+            block_free(a, ptr, osize);
+            a->bytes -= osize;
+            --a->blocks;
+        }
+        return NULL;
+    }
+
+    if(nsize > osize && a->limit > 0 && a->bytes - osize + nsize > a->limit)
+    {
+        ++a->failed;
+        return NULL;
+    }
+
+    void* p = ptr == NULL ? block_alloc(a, nsize) : block_realloc(a, ptr, osize, nsize);
+    if(p == NULL)
+        return NULL;
+    if(ptr == NULL)
+    {
+        ++a->blocks;
+        ++a->allocs;
+    }
+    a->bytes = a->bytes - osize + nsize;
+    if(a->bytes > a->peak)
+        a->peak = a->bytes;
+    return p;
+}
+
+clua_alloc* clua_alloc_create(size_t limit, int flags)
+{
+    clua_alloc* a = (clua_alloc*)calloc(1, sizeof(clua_alloc));
+    if(a == NULL)
+        return NULL;
+    a->limit = limit;
+    a->arena = (flags & CLUA_ALLOC_ARENA) != 0;
+    return a;
+}
+
+void clua_alloc_destroy(clua_alloc* a)
+{
+    if(a == NULL)
+        return;
+    chunk* c = a->chunks;
+    while(c != NULL)
+    {
+        chunk* next = c->next;
+        free(c);
+        c = next;
+    }
+    free(a);
+}
+
+static int panic(lua_State* L)
+{
+    fprintf(stderr, "PANIC: unprotected error in call to Lua API (%s)\n", lua_tostring(L, -1));
+    return 0;
+}
+
+lua_State* clua_alloc_newstate(clua_alloc* a)
+{
+    if(a == NULL)
+        return NULL;
+    lua_State* L = lua_newstate(clua_alloc_fn, a);
+    if(L != NULL)
+        lua_atpanic(L, panic);
+    return L;
+}
+
+void clua_alloc_set_limit(clua_alloc* a, size_t limit)
+{
+    a->limit = limit;
+}
+
+void clua_alloc_get_stat(const clua_alloc* a, clua_alloc_stat* stat)
+{
+    stat->bytes = a->bytes;
+    stat->peak = a->peak;
+    stat->blocks = a->blocks;
+    stat->allocs = a->allocs;
+    stat->failed = a->failed;
+    stat->reserved = a->reserved;
+    stat->limit = a->limit;
+}
+
+void clua_alloc_reset(clua_alloc* a)
+{
+    chunk* keep = NULL;
+    chunk* c = a->chunks;
+    while(c != NULL)
+    {
+        chunk* next = c->next;
+        if(keep == NULL && c->size == CHUNK_SIZE)
+        {
+            keep = c;
+        }
+        else
+        {
+            a->reserved -= c->size;
+            free(c);
+        }
+        c = next;
+    }
+    if(keep != NULL)
+    {
+        keep->next = NULL;
+        keep->used = 0;
+    }
+    a->chunks = keep;
+    memset(a->free, 0, sizeof(a->free));
+    a->bytes = 0;
+    a->blocks = 0;
+}
@@ -0,0 +1,85 @@
+/**
+ * @file clua_alloc.h
+ * @brief lua状态机内存分配器
+ *
+ * 通过 lua_newstate 传给lua, 每个状态机一个分配器. 不超过 CLUA_ALLOC_SMALL_MAX 的小块按16字节
+ * 分级, 从大块内存中切分并由各级空闲链表复用, 避免 lua_pushstring 等频繁的小分配进入malloc.
+ * 分配器只在所属状态机的线程中使用, 不加锁
+ */
+#ifndef CLUA_ALLOC_H
+#define CLUA_ALLOC_H
+
+#include "luabinding.h"
+
+#define CLUA_ALLOC_SMALL_MAX 512
+
+/**
+ * @brief 竞技场模式: 大块也从竞技场中切分, 释放时不归还, 由 @ref clua_alloc_reset 整体回收.
+ * 适用于每个请求创建一个状态机, 请求结束后 lua_close 并 reset 的场景
+ */
+#define CLUA_ALLOC_ARENA 0x1
+
+typedef struct clua_alloc clua_alloc;
+
+/**
+ * @brief 分配器统计
+ */
+typedef struct clua_alloc_stat
+{
+    size_t bytes;    ///< lua当前使用的字节数
+    size_t peak;     ///< bytes 的峰值
+    size_t blocks;   ///< 当前未释放的块数
+    size_t allocs;   ///< 累计分配次数
+    size_t failed;   ///< 因超出上限被拒绝的分配次数
+    size_t reserved; ///< 分配器从系统申请的切分用内存, 不含直接malloc的大块
+    size_t limit;    ///< 内存上限, 0表示不限制
+} clua_alloc_stat;
+
+/**
+ * @brief 创建分配器
+ * @param limit 内存上限(字节), 0表示不限制. 超出上限的分配返回NULL, lua抛出内存错误
+ * @param flags 0或 CLUA_ALLOC_ARENA
+ * @return 失败时返回NULL
+ */
+clua_alloc* clua_alloc_create(size_t limit, int flags);
+
+/**
+ * @brief 销毁分配器, 必须在使用它的状态机 lua_close 之后调用
+ * @param a 分配器
+ */
+void clua_alloc_destroy(clua_alloc* a);
+
+/**
+ * @brief 使用分配器创建状态机, 用法同 luaL_newstate
+ * @param a 分配器, 生命周期必须长于状态机; 为NULL时(如 clua_alloc_create 失败)返回NULL
+ * @return 失败时返回NULL; 64位 LuaJIT (非GC64) 不支持自定义分配器, 总是返回NULL
+ */
+lua_State* clua_alloc_newstate(clua_alloc* a);
+
+/**
+ * @brief lua_Alloc 分配函数, ud 为 clua_alloc*
+ */
+void* clua_alloc_fn(void* ud, void* ptr, size_t osize, size_t nsize);
+
+/**
+ * @brief 修改内存上限, 只影响之后的分配
+ * @param a 分配器
+ * @param limit 内存上限(字节), 0表示不限制
+ */
+void clua_alloc_set_limit(clua_alloc* a, size_t limit);
+
+/**
+ * @brief 获取统计
+ * @param a 分配器
+ * @param stat 输出统计
+ */
+void clua_alloc_get_stat(const clua_alloc* a, clua_alloc_stat* stat);
+
+/**
+ * @brief 整体回收所有内存, 保留一块切分用内存给下一个状态机, 以便复用同一个分配器
+ * @param a 分配器
+ * @note 使用它的状态机必须已经 lua_close
+ */
+void clua_alloc_reset(clua_alloc* a);
+
+#endif // CLUA_ALLOC_H
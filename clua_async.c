@@ -0,0 +1,344 @@
+#include "clua_async.h"
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+struct clua_loop
+{
+    lua_State* L;
+    int nthreads;
+    pthread_t* threads;
+    int inflight;           ///< 已提交但还未恢复协程的任务数, 只在lua线程中访问
+    clua_async_job* staged; ///< 已复制但还未提交的任务, 挂起失败时在下一次提交时回收
+
+    pthread_mutex_t lock;
+    pthread_cond_t work_cond; ///< 有新任务或事件循环停止
+    pthread_cond_t done_cond; ///< 有任务完成
+    clua_async_job* head;     ///< 待执行的任务, 先进先出
+    clua_async_job* tail;
+    clua_async_job* done; ///< 已完成的任务, 后完成的在前
+    int stop;
+};
+
+static char loop_key;    ///< 注册表中事件循环指针的键
+static char spawned_key; ///< 注册表中 spawn 创建的协程表的键, 弱键, 只有这些协程可以挂起
+
+static void* worker_main(void* arg)
+{
+    clua_loop* loop = (clua_loop*)arg;
+    pthread_mutex_lock(&loop->lock);
+    for(;;)
+    {
+        while(loop->head == NULL && !loop->stop)
+            pthread_cond_wait(&loop->work_cond, &loop->lock);
+        if(loop->head == NULL)
+            break;
+        clua_async_job* job = loop->head;
+        loop->head = job->next;
+        if(loop->head == NULL)
+            loop->tail = NULL;
+        pthread_mutex_unlock(&loop->lock);
+
+        job->run(job);
+
+        pthread_mutex_lock(&loop->lock);
+        job->next = loop->done;
+        loop->done = job;
+        pthread_cond_signal(&loop->done_cond);
+    }
+    pthread_mutex_unlock(&loop->lock);
+    return NULL;
+}
+
+static void job_free(lua_State* L, clua_async_job* job)
+{
+    luaL_unref(L, LUA_REGISTRYINDEX, job->ref);
+    free(job);
+}
+
+static void free_list(lua_State* L, clua_async_job* job)
+{
+    while(job != NULL)
+    {
+        clua_async_job* next = job->next;
+        job_free(L, job);
+        job = next;
+    }
+}
+
+static clua_loop* loop_of(lua_State* L)
+{
+    lua_pushlightuserdata(L, &loop_key);
+    lua_rawget(L, LUA_REGISTRYINDEX);
+    clua_loop* loop = (clua_loop*)lua_touserdata(L, -1);
+    lua_pop(L, 1);
+    return loop;
+}
+
+/**
+ * @brief 创建协程并登记为可挂起, 协程压入 L 的栈顶
+ */
+static lua_State* new_coroutine(lua_State* L)
+{
+    lua_State* co = lua_newthread(L);
+    lua_pushlightuserdata(L, &spawned_key);
+    lua_rawget(L, LUA_REGISTRYINDEX);
+    lua_pushvalue(L, -2);
+    lua_pushboolean(L, 1);
+    lua_rawset(L, -3);
+    lua_pop(L, 1);
+    return co;
+}
+
+/**
+ * @brief 栈顶的协程是否由 spawn 创建
+ */
+static int is_spawned(lua_State* L)
+{
+    lua_pushlightuserdata(L, &spawned_key);
+    lua_rawget(L, LUA_REGISTRYINDEX);
+    if(!lua_istable(L, -1))
+    {
+        lua_pop(L, 1);
+        return 0;
+    }
+    lua_pushvalue(L, -2);
+    lua_rawget(L, -2);
+    int spawned = lua_toboolean(L, -1);
+    lua_pop(L, 2);
+    return spawned;
+}
+
+int clua_async_submit(lua_State* L, const clua_async_job* job, size_t size)
+{
+    clua_loop* loop = loop_of(L);
+    if(loop != NULL && loop->staged != NULL)
+    {
+        job_free(L, loop->staged);
+        loop->staged = NULL;
+    }
+
+    /* 只有 spawn 创建的协程由事件循环恢复; 主线程和用户自己的协程挂起后会被当作普通的
+     * coroutine.yield, 直接执行 */
+    lua_pushthread(L);
+    if(loop == NULL || !is_spawned(L))
+    {
+        lua_pop(L, 1);
+        clua_async_job* copy = (clua_async_job*)malloc(size);
+        if(copy == NULL)
+            return luaL_error(L, "clua_async_submit failed! out of memory");
+        memcpy(copy, job, size);
+        copy->run(copy);
+        int n = copy->push(L, copy);
+        free(copy);
+        return n;
+    }
+
+    clua_async_job* copy = (clua_async_job*)malloc(size);
+    if(copy == NULL)
+        return luaL_error(L, "clua_async_submit failed! out of memory");
+    memcpy(copy, job, size);
+    copy->co = L;
+    copy->ref = luaL_ref(L, LUA_REGISTRYINDEX);
+    copy->next = NULL;
+
+    /* 在 pcall 或元方法中调用时 lua_yield 抛出错误而不返回, 此时任务留在 staged 中,
+     * 所以必须先挂起再提交 */
+    loop->staged = copy;
+    int ret = lua_yield(L, 0);
+    loop->staged = NULL;
+
+    ++loop->inflight;
+    pthread_mutex_lock(&loop->lock);
+    if(loop->tail != NULL)
+        loop->tail->next = copy;
+    else
+        loop->head = copy;
+    loop->tail = copy;
+    pthread_cond_signal(&loop->work_cond);
+    pthread_mutex_unlock(&loop->lock);
+    return ret;
+}
+
+static void report(lua_State* co)
+{
+    const char* msg = lua_tostring(co, -1);
+    fprintf(stderr, "clua_loop: %s\n", msg != NULL ? msg : "(error object is not a string)");
+}
+
+/**
+ * @brief 将任务结果传给协程并恢复执行
+ * @return 协程是否出错
+ */
+static int resume(clua_loop* loop, clua_async_job* job)
+{
+    lua_State* co = job->co;
+    int failed = 0;
+    if(lua_status(co) == LUA_YIELD)
+    {
+        int n = job->push(co, job);
+        int status = lua_resume(co, n);
+        if(status != 0 && status != LUA_YIELD)
+        {
+            report(co);
+            failed = 1;
+        }
+    }
+    /* 恢复期间协程可能只被这个引用持有, 结束后才能释放 */
+    job_free(loop->L, job);
+    return failed;
+}
+
+int clua_loop_run(clua_loop* loop)
+{
+    int failed = 0;
+    while(loop->inflight > 0)
+    {
+        pthread_mutex_lock(&loop->lock);
+        while(loop->done == NULL)
+            pthread_cond_wait(&loop->done_cond, &loop->lock);
+        clua_async_job* done = loop->done;
+        loop->done = NULL;
+        pthread_mutex_unlock(&loop->lock);
+
+        /* 按完成顺序恢复 */
+        clua_async_job* list = NULL;
+        while(done != NULL)
+        {
+            clua_async_job* next = done->next;
+            done->next = list;
+            list = done;
+            done = next;
+        }
+        while(list != NULL)
+        {
+            clua_async_job* next = list->next;
+            --loop->inflight;
+            failed += resume(loop, list);
+            list = next;
+        }
+    }
+    return failed;
+}
+
+int clua_loop_spawn(clua_loop* loop, int nargs)
+{
+    lua_State* L = loop->L;
+    lua_State* co = new_coroutine(L);
+    lua_insert(L, -(nargs + 2));
+    lua_xmove(L, co, nargs + 1);
+    int status = lua_resume(co, nargs);
+    if(status == LUA_YIELD)
+        status = 0;
+    if(status != 0)
+        lua_xmove(co, L, 1);
+    lua_remove(L, status != 0 ? -2 : -1);
+    return status;
+}
+
+/**
+ * @brief clua.spawn(f, ...) 在新协程中调用 f, 不返回协程, 挂起后只能由事件循环恢复
+ */
+static int spawn(lua_State* L)
+{
+    luaL_checktype(L, 1, LUA_TFUNCTION);
+    int nargs = lua_gettop(L) - 1;
+    lua_State* co = new_coroutine(L);
+    lua_insert(L, 1);
+    lua_xmove(L, co, nargs + 1);
+    int status = lua_resume(co, nargs);
+    if(status != 0 && status != LUA_YIELD)
+        report(co);
+    return 0;
+}
+
+static void loop_free(clua_loop* loop, int started)
+{
+    pthread_mutex_lock(&loop->lock);
+    loop->stop = 1;
+    pthread_cond_broadcast(&loop->work_cond);
+    pthread_mutex_unlock(&loop->lock);
+    for(int i = 0; i < started; ++i)
+    {
+        pthread_join(loop->threads[i], NULL);
+    }
+
+    free_list(loop->L, loop->done);
+    if(loop->staged != NULL)
+        job_free(loop->L, loop->staged);
+    pthread_mutex_destroy(&loop->lock);
+    pthread_cond_destroy(&loop->work_cond);
+    pthread_cond_destroy(&loop->done_cond);
+    free(loop->threads);
+    free(loop);
+}
+
+clua_loop* clua_loop_create(lua_State* L, int nthreads)
+{
+    if(nthreads <= 0)
+        nthreads = (int)sysconf(_SC_NPROCESSORS_ONLN);
+    if(nthreads <= 0)
+        nthreads = 1;
+
+    clua_loop* loop = (clua_loop*)calloc(1, sizeof(clua_loop));
+    if(loop == NULL)
+        return NULL;
+    loop->threads = (pthread_t*)calloc((size_t)nthreads, sizeof(pthread_t));
+    if(loop->threads == NULL)
+    {
+        free(loop);
+        return NULL;
+    }
+    loop->L = L;
+    loop->nthreads = nthreads;
+    pthread_mutex_init(&loop->lock, NULL);
+    pthread_cond_init(&loop->work_cond, NULL);
+    pthread_cond_init(&loop->done_cond, NULL);
+    for(int i = 0; i < nthreads; ++i)
+    {
+        if(pthread_create(&loop->threads[i], NULL, worker_main, loop) != 0)
+        {
+            loop_free(loop, i);
+            return NULL;
+        }
+    }
+
+    lua_pushlightuserdata(L, &loop_key);
+    lua_pushlightuserdata(L, loop);
+    lua_rawset(L, LUA_REGISTRYINDEX);
+
+    lua_pushlightuserdata(L, &spawned_key);
+    lua_newtable(L);
+    lua_createtable(L, 0, 1);
+    lua_pushliteral(L, "k");
+    lua_setfield(L, -2, "__mode");
+    lua_setmetatable(L, -2);
+    lua_rawset(L, LUA_REGISTRYINDEX);
+
+    lua_getfield(L, LUA_GLOBALSINDEX, "clua");
+    if(lua_istable(L, -1))
+    {
+        lua_pushcfunction(L, spawn);
+        lua_setfield(L, -2, "spawn");
+    }
+    lua_pop(L, 1);
+    return loop;
+}
+
+void clua_loop_destroy(clua_loop* loop)
+{
+    lua_State* L = loop->L;
+    lua_pushlightuserdata(L, &loop_key);
+    lua_pushnil(L);
+    lua_rawset(L, LUA_REGISTRYINDEX);
+
+    /* 未执行的任务直接丢弃, 正在执行的任务等待工作线程返回后丢弃 */
+    pthread_mutex_lock(&loop->lock);
+    clua_async_job* queued = loop->head;
+    loop->head = loop->tail = NULL;
+    pthread_mutex_unlock(&loop->lock);
+    free_list(L, queued);
+    loop_free(loop, loop->nthreads);
+}
@@ -0,0 +1,186 @@
+/**
+ * @file clua_async.h
+ * @brief 异步lua接口和事件循环
+ *
+ * CLUA_DEF_ASYNC 生成的接口在调用它的协程中取出参数, 将C函数交给事件循环的工作线程执行, 然后挂起
+ * 协程. C函数执行完毕后, 事件循环在lua所在的线程中压入返回值并恢复协程. 这样一个lua状态机中的
+ * 大量协程可以同时等待各自的阻塞操作, 而lua本身始终只在一个线程中运行
+ */
+#ifndef CLUA_ASYNC_H
+#define CLUA_ASYNC_H
+
+#include "luabinding.h"
+
+typedef struct clua_loop clua_loop;
+typedef struct clua_async_job clua_async_job;
+
+/**
+ * @brief 异步任务, 由 CLUA_DEF_ASYNC 生成的结构体以它开头
+ */
+struct clua_async_job
+{
+    void (*run)(clua_async_job* job);             ///< 在工作线程中调用C函数
+    int (*push)(lua_State* L, clua_async_job* job); ///< 在lua线程中压入返回值, 返回个数
+    lua_State* co;                                ///< 等待结果的协程
+    int ref;                                      ///< 协程在注册表中的引用, 防止被回收
+    clua_async_job* next;
+};
+
+/**
+ * @brief 创建事件循环, 并在全局 clua 表中注册 clua.spawn(f, ...)
+ * @param L lua状态机, 事件循环只能在该状态机所在的线程中运行
+ * @param nthreads 执行C函数的工作线程数, 小于等于0时使用CPU核数
+ * @return 失败时返回NULL
+ */
+clua_loop* clua_loop_create(lua_State* L, int nthreads);
+
+/**
+ * @brief 销毁事件循环, 等待工作线程中正在执行的C函数返回, 未恢复的协程被丢弃
+ * @param loop 事件循环
+ */
+void clua_loop_destroy(clua_loop* loop);
+
+/**
+ * @brief 在新协程中调用函数, 用法同 lua_pcall
+ *
+ * 堆栈上依次为函数和 nargs 个参数, 调用后都被弹出. 函数运行到第一个异步接口或结束时返回.
+ * 协程不会返回给调用者, 挂起后只由事件循环恢复
+ * @param loop 事件循环
+ * @param nargs 参数个数
+ * @return lua状态码, 挂起时返回0; 失败时栈顶为错误信息
+ */
+int clua_loop_spawn(clua_loop* loop, int nargs);
+
+/**
+ * @brief 运行事件循环, 直到没有等待中的异步任务
+ * @param loop 事件循环
+ * @return 恢复后出错的协程数, 错误信息输出到 stderr
+ */
+int clua_loop_run(clua_loop* loop);
+
+/**
+ * @brief 提交异步任务并挂起当前协程, 由 CLUA_DEF_ASYNC 生成的接口调用
+ *
+ * 只有 clua.spawn 或 clua_loop_spawn 创建的协程会挂起; 在主线程, coroutine.create 创建的协程中
+ * 或状态机没有事件循环时, 直接在当前线程中执行任务
+ * @param L 当前协程
+ * @param job 任务, 会被复制
+ * @param size 任务大小
+ * @return lua_CFunction 的返回值
+ */
+int clua_async_submit(lua_State* L, const clua_async_job* job, size_t size);
+
+/**
+ * @brief 定义异步lua接口, 参数同 @ref CLUA_DEF, 在lua中的名字和注册方式也与 CLUA_DEF 相同
+ *
+ * C函数在工作线程中执行, 不能访问lua. 's' 'b' 'B' 等指向lua内存的参数在协程挂起期间
+ * 仍留在协程的堆栈上, 执行期间保持有效. 接口只能在 clua.spawn 或 clua_loop_spawn 创建的协程中
+ * 挂起, 在其它地方调用时同步执行
+ *
+ * @note 示例
+ * int read_config(const char* path); // 阻塞
+ * CLUA_DEF_ASYNC(read_config, "ds", int, const char*)
+ * -- lua: clua.spawn(function() print(read_config("a.conf")) end)
+ */
+#define CLUA_DEF_ASYNC(f, fmt, argret, ...)                                                        \
+    IMPL_CLUA_CAT(IMPL_CLUA_DEF_ASYNC_, IMPL_CLUA_CHECK(argret))(f, fmt, argret, ##__VA_ARGS__)
+
+
+/*******************
+ * 实现部分
+ ******************/
+#define IMPL_CLUA_ASYNC_JOB(f) _clua_async_job_##f
+#define IMPL_CLUA_ASYNC_FIELD(c, i, type) IMPL_CLUA_ARG_TYPE(type) a##i;
+#define IMPL_CLUA_ASYNC_ARG(c, i, type) , IMPL_CLUA_IF_OUT(type, &, ) c->a##i
+
+/**
+ * @brief 在lua线程中取出输入参数, 输出参数初始化为0
+ */
+#define IMPL_CLUA_ASYNC_GET(c, i, type)                                                            \
+    IMPL_CLUA_IF_OUT(type, IMPL_CLUA_ASYNC_OUT_GET, IMPL_CLUA_ASYNC_IN_GET)(c, i, type)
+#define IMPL_CLUA_ASYNC_IN_GET(c, i, type) c.a##i = IMPL_CLUA_GET(type, ++impl_clua_n);
+#define IMPL_CLUA_ASYNC_OUT_GET(c, i, type) c.a##i = (IMPL_CLUA_UNPAREN type){ 0 };
+
+/**
+ * @brief 在返回值后面压入输出参数
+ */
+#define IMPL_CLUA_ASYNC_PUSH(c, i, type)                                                           \
+    IMPL_CLUA_IF_OUT(type, IMPL_CLUA_ASYNC_OUT_PUSH, IMPL_CLUA_IN_PUSH)(c, i, type)
+#define IMPL_CLUA_ASYNC_OUT_PUSH(fmt, i, type)                                                     \
+    n += IMPL_CLUA_SET_AS((fmt)[i], IMPL_CLUA_UNPAREN type, job->a##i);
+
+/**
+ * @brief 任务参数列表 j->a1, &j->a2, ...
+ */
+#define IMPL_CLUA_ASYNC_ARGS(j, ...)                                                               \
+    IMPL_CLUA_DROP(~IMPL_CLUA_FOREACH(IMPL_CLUA_ASYNC_ARG, j, ##__VA_ARGS__))
+
+/**
+ * @brief 生成接口函数, 在lua线程中取出参数后提交任务
+ */
+#define IMPL_CLUA_ASYNC_WRAPPER(f, fmt, cond, ...)                                                 \
+    IMPL_CLUA_WRAPPER(#f, CLUA_FNAME(f))                                                           \
+    {                                                                                              \
+        IMPL_CLUA_FMT_ASSERT(fmt, PP_NARG(__VA_ARGS__) + 1,                                        \
+                             cond IMPL_CLUA_FOREACH(IMPL_CLUA_ARG_FMT, fmt, ##__VA_ARGS__));       \
+        int impl_clua_n = 0;                                                                       \
+        (void)impl_clua_n;                                                                         \
+        IMPL_CLUA_ASYNC_JOB(f) job;                                                                \
+        job.base.run = IMPL_CLUA_CAT(IMPL_CLUA_ASYNC_JOB(f), _run);                                \
+        job.base.push = IMPL_CLUA_CAT(IMPL_CLUA_ASYNC_JOB(f), _push);                              \
+        IMPL_CLUA_FOREACH(IMPL_CLUA_ASYNC_GET, job, ##__VA_ARGS__)                                 \
+        IMPL_CLUA_ARGS_DONE();                                                                     \
+        return clua_async_submit(L, &job.base, sizeof(job));                                       \
+    }
+
+#define IMPL_CLUA_DEF_ASYNC_0(f, fmt, argret, ...)                                                 \
+    typedef struct IMPL_CLUA_ASYNC_JOB(f)                                                          \
+    {                                                                                              \
+        clua_async_job base;                                                                       \
+        argret ret;                                                                                \
+        IMPL_CLUA_FOREACH(IMPL_CLUA_ASYNC_FIELD, ~, ##__VA_ARGS__)                                 \
+    } IMPL_CLUA_ASYNC_JOB(f);                                                                      \
+                                                                                                   \
+    static void IMPL_CLUA_CAT(IMPL_CLUA_ASYNC_JOB(f), _run)(clua_async_job * base)                 \
+    {                                                                                              \
+        IMPL_CLUA_ASYNC_JOB(f)* job = (IMPL_CLUA_ASYNC_JOB(f)*)base;                               \
+        job->ret = f(IMPL_CLUA_ASYNC_ARGS(job, ##__VA_ARGS__));                                    \
+    }                                                                                              \
+                                                                                                   \
+    static int IMPL_CLUA_CAT(IMPL_CLUA_ASYNC_JOB(f), _push)(lua_State * L, clua_async_job * base)  \
+    {                                                                                              \
+        IMPL_CLUA_ASYNC_JOB(f)* job = (IMPL_CLUA_ASYNC_JOB(f)*)base;                               \
+        int n = IMPL_CLUA_SET_AS((fmt)[0], argret, job->ret);                                      \
+        IMPL_CLUA_FOREACH(IMPL_CLUA_ASYNC_PUSH, fmt, ##__VA_ARGS__)                                \
+        return n;                                                                                  \
+    }                                                                                              \
+                                                                                                   \
+    IMPL_CLUA_ASYNC_WRAPPER(f, fmt, IMPL_CLUA_FMT_IS(fmt, 0, argret), ##__VA_ARGS__)
+
+#define IMPL_CLUA_DEF_ASYNC_1(f, fmt, _1, _2, ...)                                                 \
+    typedef struct IMPL_CLUA_ASYNC_JOB(f)                                                          \
+    {                                                                                              \
+        clua_async_job base;                                                                       \
+        IMPL_CLUA_FOREACH(IMPL_CLUA_ASYNC_FIELD, ~, ##__VA_ARGS__)                                 \
+    } IMPL_CLUA_ASYNC_JOB(f);                                                                      \
+                                                                                                   \
+    static void IMPL_CLUA_CAT(IMPL_CLUA_ASYNC_JOB(f), _run)(clua_async_job * base)                 \
+    {                                                                                              \
+        IMPL_CLUA_ASYNC_JOB(f)* job = (IMPL_CLUA_ASYNC_JOB(f)*)base;                               \
+        (void)job;                                                                                 \
+        f(IMPL_CLUA_ASYNC_ARGS(job, ##__VA_ARGS__));                                               \
+    }                                                                                              \
+                                                                                                   \
+    static int IMPL_CLUA_CAT(IMPL_CLUA_ASYNC_JOB(f), _push)(lua_State * L, clua_async_job * base)  \
+    {                                                                                              \
+        IMPL_CLUA_ASYNC_JOB(f)* job = (IMPL_CLUA_ASYNC_JOB(f)*)base;                               \
+        int n = 0;                                                                                 \
+        (void)L;                                                                                   \
+        (void)job;                                                                                 \
+        IMPL_CLUA_FOREACH(IMPL_CLUA_ASYNC_PUSH, fmt, ##__VA_ARGS__)                                \
+        return n;                                                                                  \
+    }                                                                                              \
+                                                                                                   \
+    IMPL_CLUA_ASYNC_WRAPPER(f, fmt, (fmt)[0] == 'v', ##__VA_ARGS__)
+
+#endif // CLUA_ASYNC_H
@@ -0,0 +1,240 @@
+#include "clua_cache.h"
+#include <fcntl.h>
+#include <limits.h>
+#include <stddef.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+
+#define CACHE_MAGIC "CLUAC01"
+
+/**
+ * @brief 缓存文件头, 其后紧跟 lua_dump 输出的字节码
+ */
+typedef struct cache_header
+{
+    char magic[8];
+    long long mtime; ///< 脚本修改时间(ns)
+    long long size;  ///< 脚本大小
+    uint64_t hash;   ///< 脚本内容哈希
+} cache_header;
+
+typedef struct chunk_reader
+{
+    const char* data;
+    size_t size;
+} chunk_reader;
+
+static unsigned long long now_ns(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (unsigned long long)ts.tv_sec * 1000000000ull + (unsigned long long)ts.tv_nsec;
+}
+
+static uint64_t fnv1a(const void* data, size_t size)
+{
+    const unsigned char* p = (const unsigned char*)data;
+    uint64_t hash = 14695981039346656037ull;
+    for(size_t i = 0; i < size; ++i)
+    {
+        hash ^= p[i];
+        hash *= 1099511628211ull;
+    }
+    return hash;
+}
+
+/**
+ * @brief 一次性返回整块内存, 不复制
+ */
+static const char* read_chunk(lua_State* L, void* ud, size_t* size)
+{
+    chunk_reader* reader = (chunk_reader*)ud;
+    (void)L;
+    *size = reader->size;
+    reader->size = 0;
+    return *size > 0 ? reader->data : NULL;
+}
+
+static int write_chunk(lua_State* L, const void* p, size_t size, void* ud)
+{
+    (void)L;
+    return fwrite(p, 1, size, (FILE*)ud) == size ? 0 : 1;
+}
+
+/**
+ * @brief 缓存文件路径: 缓存目录/脚本绝对路径哈希.luac
+ */
+static void cache_path(char* buf, size_t size, const char* path, const char* cache_dir)
+{
+    char real[PATH_MAX];
+    if(realpath(path, real) == NULL)
+        snprintf(real, sizeof(real), "%s", path);
+    snprintf(buf, size, "%s/%016llx.luac", cache_dir,
+             (unsigned long long)fnv1a(real, strlen(real)));
+}
+
+static void* map_file(const char* path, size_t* size)
+{
+    int fd = open(path, O_RDONLY);
+    if(fd < 0)
+        return NULL;
+    struct stat st;
+    void* data = NULL;
+    if(fstat(fd, &st) == 0 && st.st_size > 0)
+    {
+        data = mmap(NULL, (size_t)st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+        if(data == MAP_FAILED)
+            data = NULL;
+        *size = (size_t)st.st_size;
+    }
+    close(fd);
+    return data;
+}
+
+/**
+ * @brief 只改写缓存文件头中的修改时间, 用于内容未变而修改时间变了的脚本(如重新检出),
+ * 避免之后每次加载都要重新计算哈希
+ */
+static void refresh_mtime(const char* cache, long long mtime)
+{
+    int fd = open(cache, O_WRONLY);
+    if(fd < 0)
+        return;
+    ssize_t n = pwrite(fd, &mtime, sizeof(mtime), offsetof(cache_header, mtime));
+    (void)n;
+    close(fd);
+}
+
+/**
+ * @brief 从缓存加载, 缓存有效时返回lua状态码, 缓存缺失或过期时返回-1
+ */
+static int load_cache(lua_State* L, const char* cache, const char* chunkname,
+                      const cache_header* key, const void* source, size_t source_size)
+{
+    size_t size = 0;
+    char* data = (char*)map_file(cache, &size);
+    if(data == NULL)
+        return -1;
+
+    int status = -1;
+    const cache_header* header = (const cache_header*)data;
+    if(size > sizeof(cache_header) &&
+       memcmp(header->magic, CACHE_MAGIC, sizeof(CACHE_MAGIC)) == 0 && header->size == key->size &&
+       (header->mtime == key->mtime || header->hash == fnv1a(source, source_size)))
+    {
+        chunk_reader reader = { data + sizeof(cache_header), size - sizeof(cache_header) };
+        status = lua_load(L, read_chunk, &reader, chunkname);
+        if(status != 0)
+        {
+            lua_pop(L, 1);
+            status = -1;
+        }
+        else if(header->mtime != key->mtime)
+        {
+            refresh_mtime(cache, key->mtime);
+        }
+    }
+    munmap(data, size);
+    return status;
+}
+
+/**
+ * @brief 将栈顶函数的字节码写入缓存, 先写临时文件再改名, 避免其它进程读到不完整的文件
+ * @note 临时文件由 mkstemp 创建, 同一进程的多个线程同时写同一个缓存也不会冲突
+ */
+static int store_cache(lua_State* L, const char* cache, const cache_header* key)
+{
+    char tmp[PATH_MAX + 64];
+    snprintf(tmp, sizeof(tmp), "%s.XXXXXX", cache);
+    int fd = mkstemp(tmp);
+    if(fd < 0)
+        return 0;
+    FILE* fp = fchmod(fd, 0644) == 0 ? fdopen(fd, "wb") : NULL;
+    if(fp == NULL)
+    {
+        close(fd);
+        remove(tmp);
+        return 0;
+    }
+
+    int ok = fwrite(key, sizeof(cache_header), 1, fp) == 1 && lua_dump(L, write_chunk, fp) == 0;
+    ok = fclose(fp) == 0 && ok;
+    if(!ok || rename(tmp, cache) != 0)
+    {
+        remove(tmp);
+        return 0;
+    }
+    return 1;
+}
+
+int clua_loadfile_cached(lua_State* L, const char* path, const char* cache_dir,
+                         clua_cache_info* info)
+{
+    clua_cache_info result = { 0, 0, 0 };
+    unsigned long long start = now_ns();
+    int status;
+
+    struct stat st;
+    size_t size = 0;
+    char* source = NULL;
+    if(cache_dir == NULL || stat(path, &st) != 0 ||
+       (source = (char*)map_file(path, &size)) == NULL)
+    {
+        status = luaL_loadfile(L, path);
+        goto done;
+    }
+
+    cache_header key;
+    memset(&key, 0, sizeof(key));
+    memcpy(key.magic, CACHE_MAGIC, sizeof(CACHE_MAGIC));
+    key.mtime = (long long)st.st_mtim.tv_sec * 1000000000ll + st.st_mtim.tv_nsec;
+    key.size = (long long)size;
+
+    char cache[PATH_MAX + 32];
+    char chunkname[PATH_MAX + 1];
+    cache_path(cache, sizeof(cache), path, cache_dir);
+    snprintf(chunkname, sizeof(chunkname), "@%s", path);
+
+    status = load_cache(L, cache, chunkname, &key, source, size);
+    if(status >= 0)
+    {
+        result.hit = 1;
+    }
+    else
+    {
+        /* 同 luaL_loadfile, 跳过首行的 #!, 保留换行使行号不变 */
+        chunk_reader reader = { source, size };
+        if(size > 0 && source[0] == '#')
+        {
+            const char* eol = (const char*)memchr(source, '\n', size);
+            reader.data = eol != NULL ? eol : source + size;
+            reader.size = (size_t)(source + size - reader.data);
+        }
+        status = lua_load(L, read_chunk, &reader, chunkname);
+        if(status == 0)
+        {
+            key.hash = fnv1a(source, size);
+            result.stored = store_cache(L, cache, &key);
+        }
+    }
+    munmap(source, size);
+
+done:
+    result.ns = now_ns() - start;
+    if(info != NULL)
+        *info = result;
+    return status;
+}
+
+int clua_dofile_cached(lua_State* L, const char* path, const char* cache_dir,
+                       clua_cache_info* info)
+{
+    int status = clua_loadfile_cached(L, path, cache_dir, info);
+    if(status != 0)
+        return status;
+    return lua_pcall(L, 0, LUA_MULTRET, 0);
+}
@@ -0,0 +1,48 @@
+/**
+ * @file clua_cache.h
+ * @brief lua脚本字节码缓存
+ *
+ * 脚本第一次加载时用 lua_dump 编译结果写入缓存目录, 之后的启动直接通过 mmap 映射缓存文件,
+ * 由 lua_load 从映射内存中读取字节码, 跳过词法和语法分析. 缓存文件以脚本路径命名,
+ * 文件头记录脚本的修改时间, 大小和内容哈希, 不一致时重新从源码加载并更新缓存;
+ * 只有修改时间变化而内容哈希相同时沿用缓存, 并更新文件头中的修改时间
+ */
+#ifndef CLUA_CACHE_H
+#define CLUA_CACHE_H
+
+#include "luabinding.h"
+
+/**
+ * @brief 一次加载的结果
+ */
+typedef struct clua_cache_info
+{
+    int hit;               ///< 是否从缓存加载
+    int stored;            ///< 是否写入了新的缓存
+    unsigned long long ns; ///< 加载耗时
+} clua_cache_info;
+
+/**
+ * @brief 加载脚本, 用法同 luaL_loadfile
+ * @param L lua状态机
+ * @param path 脚本路径
+ * @param cache_dir 缓存目录, 必须已存在; 为NULL时等同于 luaL_loadfile
+ * @param info 输出加载结果, 可为NULL
+ * @return lua状态码, 成功时编译好的函数位于栈顶, 失败时栈顶为错误信息
+ * @note 缓存读写失败时静默回退到源码加载, 不会影响脚本本身的加载结果
+ */
+int clua_loadfile_cached(lua_State* L, const char* path, const char* cache_dir,
+                         clua_cache_info* info);
+
+/**
+ * @brief 加载并执行脚本, 用法同 luaL_dofile
+ * @param L lua状态机
+ * @param path 脚本路径
+ * @param cache_dir 缓存目录, 含义同 @ref clua_loadfile_cached
+ * @param info 输出加载结果, 可为NULL
+ * @return lua状态码
+ */
+int clua_dofile_cached(lua_State* L, const char* path, const char* cache_dir,
+                       clua_cache_info* info);
+
+#endif // CLUA_CACHE_H
@@ -0,0 +1,388 @@
+#include "clua_callback.h"
+#include <stdarg.h>
+#include <stdlib.h>
+
+#define NO_STRING SIZE_MAX
+
+/**
+ * @brief 单个参数, 各成员都位于起始地址, 可以直接传给 lua_set_value
+ */
+typedef union callback_value
+{
+    int d;
+    unsigned u;
+    float f;
+    long long D;
+    unsigned long long U;
+    double F;
+    const char* s;
+    void* p;
+    clua_buffer b;
+    clua_bytes* B;
+    clua_floats x;
+    clua_doubles X;
+    clua_int32s i;
+    clua_int64s I;
+} callback_value;
+
+struct clua_callback
+{
+    lua_State* L;
+    char fmt[CLUA_CALLBACK_MAX_ARGS + 2];
+    int nargs;
+    int func;    ///< lua函数的引用
+    int handler; ///< 错误处理函数的引用
+    int invoke;  ///< 调用函数的引用
+    int anchor;  ///< 保存最近一次的返回值或错误信息, 使其在下一次调用前不被回收
+    int failed;
+
+    callback_value* queue; ///< 队列中的事件, 每个事件 nargs 个参数
+    size_t count;
+    size_t capacity;
+    char* strings; ///< 队列中 's' 'b' 参数的内容, 参数中保存偏移
+    size_t strings_len;
+    size_t strings_cap;
+    int flushing;
+};
+
+/**
+ * @brief 一次保护调用中要传递的事件
+ */
+typedef struct callback_batch
+{
+    clua_callback* cb;
+    const callback_value* args; ///< 单次调用的参数, 为NULL时传递队列中的事件
+    void* ret;
+    size_t done; ///< 已传递的事件数
+} callback_batch;
+
+static char callback_key; ///< 注册表中 { 错误处理函数, 调用函数 } 的键
+
+static int callback_error(lua_State* L)
+{
+    if(!lua_isstring(L, 1) || !lua_isfunction(L, lua_upvalueindex(1)))
+        return 1;
+    lua_pushvalue(L, lua_upvalueindex(1));
+    lua_pushvalue(L, 1);
+    lua_pushinteger(L, 2);
+    lua_call(L, 2, 1);
+    return 1;
+}
+
+/**
+ * @param queued 是否为队列中的参数, 其 's' 'b' 内容保存在字符串区
+ */
+static void push_arg(lua_State* L, const clua_callback* cb, char type, const callback_value* value,
+                     int queued)
+{
+    if(queued && type == 's')
+    {
+        if(value->U == NO_STRING)
+            lua_pushnil(L);
+        else
+            lua_pushstring(L, cb->strings + value->U);
+    }
+    else if(queued && type == 'b')
+    {
+        lua_pushlstring(L, cb->strings + (size_t)(uintptr_t)value->b.data, value->b.len);
+    }
+    else
+    {
+        lua_set_value(L, type, (void*)value);
+    }
+}
+
+static int callback_invoke(lua_State* L)
+{
+    callback_batch* batch = (callback_batch*)lua_touserdata(L, 1);
+    clua_callback* cb = batch->cb;
+    char ret = cb->fmt[0];
+    size_t count = batch->args != NULL ? 1 : cb->count;
+
+    /* 队列在lua函数中可能扩容, 每个事件都重新取地址 */
+    for(; batch->done < count; count = batch->args != NULL ? 1 : cb->count)
+    {
+        const callback_value* args =
+            batch->args != NULL ? batch->args : cb->queue + batch->done * (size_t)cb->nargs;
+        lua_rawgeti(L, LUA_REGISTRYINDEX, cb->func);
+        for(int i = 0; i < cb->nargs; ++i)
+        {
+            push_arg(L, cb, cb->fmt[i + 1], &args[i], batch->args == NULL);
+        }
+        lua_call(L, cb->nargs, ret == 'v' ? 0 : 1);
+        if(ret != 'v')
+        {
+            if(batch->ret != NULL)
+            {
+                lua_get_value(L, -1, ret, batch->ret);
+                if(strchr("sbBxXiI", ret) != NULL)
+                {
+                    lua_pushvalue(L, -1);
+                    lua_rawseti(L, LUA_REGISTRYINDEX, cb->anchor);
+                }
+            }
+            lua_pop(L, 1);
+        }
+        ++batch->done;
+    }
+    return 0;
+}
+
+static int callback_run(clua_callback* cb, callback_batch* batch)
+{
+    lua_State* L = cb->L;
+    int top = lua_gettop(L);
+    lua_rawgeti(L, LUA_REGISTRYINDEX, cb->handler);
+    lua_rawgeti(L, LUA_REGISTRYINDEX, cb->invoke);
+    lua_pushlightuserdata(L, batch);
+    int status = lua_pcall(L, 1, 0, top + 1);
+    cb->failed = status != 0;
+    if(cb->failed)
+        lua_rawseti(L, LUA_REGISTRYINDEX, cb->anchor);
+    lua_settop(L, top);
+    return status;
+}
+
+static void read_args(const clua_callback* cb, callback_value* args, va_list ap)
+{
+    for(int i = 0; i < cb->nargs; ++i)
+    {
+        callback_value* value = &args[i];
+        switch(cb->fmt[i + 1])
+        {
+        case 'd':
+            value->d = va_arg(ap, int);
+            break;
+        case 'u':
+            value->u = va_arg(ap, unsigned);
+            break;
+        case 'f':
+            value->f = (float)va_arg(ap, double);
+            break;
+        case 'D':
+            value->D = va_arg(ap, long long);
+            break;
+        case 'U':
+            value->U = va_arg(ap, unsigned long long);
+            break;
+        case 'F':
+            value->F = va_arg(ap, double);
+            break;
+        case 's':
+            value->s = va_arg(ap, const char*);
+            break;
+        case 'p':
+            value->p = va_arg(ap, void*);
+            break;
+        case 'b':
+            value->b = va_arg(ap, clua_buffer);
+            break;
+        case 'B':
+            value->B = va_arg(ap, clua_bytes*);
+            break;
+        case 'x':
+            value->x = va_arg(ap, clua_floats);
+            break;
+        case 'X':
+            value->X = va_arg(ap, clua_doubles);
+            break;
+        case 'i':
+            value->i = va_arg(ap, clua_int32s);
+            break;
+        case 'I':
+            value->I = va_arg(ap, clua_int64s);
+            break;
+        }
+    }
+}
+
+/**
+ * @brief 取出本状态机共用的错误处理函数和调用函数, 第一次使用时创建
+ */
+static void push_shared(lua_State* L)
+{
+    lua_pushlightuserdata(L, &callback_key);
+    lua_rawget(L, LUA_REGISTRYINDEX);
+    if(!lua_isnil(L, -1))
+        return;
+    lua_pop(L, 1);
+
+    lua_createtable(L, 2, 0);
+    lua_getfield(L, LUA_GLOBALSINDEX, "debug");
+    if(lua_istable(L, -1))
+        lua_getfield(L, -1, "traceback");
+    else
+        lua_pushnil(L);
+    lua_remove(L, -2);
+    lua_pushcclosure(L, callback_error, 1);
+    lua_rawseti(L, -2, 1);
+    lua_pushcfunction(L, callback_invoke);
+    lua_rawseti(L, -2, 2);
+    lua_pushlightuserdata(L, &callback_key);
+    lua_pushvalue(L, -2);
+    lua_rawset(L, LUA_REGISTRYINDEX);
+}
+
+clua_callback* clua_callback_new(lua_State* L, int index, const char* fmt)
+{
+    size_t len = strlen(fmt);
+    if(!lua_isfunction(L, index) || len == 0 || len > CLUA_CALLBACK_MAX_ARGS + 1 ||
+       strchr("vdufDUFspbBxXiI", fmt[0]) == NULL || strspn(fmt + 1, "dufDUFspbBxXiI") != len - 1)
+        return NULL;
+
+    clua_callback* cb = (clua_callback*)calloc(1, sizeof(clua_callback));
+    if(cb == NULL)
+        return NULL;
+    cb->L = L;
+    memcpy(cb->fmt, fmt, len + 1);
+    cb->nargs = (int)len - 1;
+
+    lua_pushvalue(L, index);
+    cb->func = luaL_ref(L, LUA_REGISTRYINDEX);
+    push_shared(L);
+    lua_rawgeti(L, -1, 1);
+    cb->handler = luaL_ref(L, LUA_REGISTRYINDEX);
+    lua_rawgeti(L, -1, 2);
+    cb->invoke = luaL_ref(L, LUA_REGISTRYINDEX);
+    lua_pop(L, 1);
+    lua_pushboolean(L, 0);
+    cb->anchor = luaL_ref(L, LUA_REGISTRYINDEX);
+    return cb;
+}
+
+clua_callback* clua_callback_global(lua_State* L, const char* name, const char* fmt)
+{
+    lua_getfield(L, LUA_GLOBALSINDEX, name);
+    clua_callback* cb = clua_callback_new(L, -1, fmt);
+    lua_pop(L, 1);
+    return cb;
+}
+
+void clua_callback_free(clua_callback* cb)
+{
+    if(cb == NULL)
+        return;
+    luaL_unref(cb->L, LUA_REGISTRYINDEX, cb->func);
+    luaL_unref(cb->L, LUA_REGISTRYINDEX, cb->handler);
+    luaL_unref(cb->L, LUA_REGISTRYINDEX, cb->invoke);
+    luaL_unref(cb->L, LUA_REGISTRYINDEX, cb->anchor);
+    free(cb->queue);
+    free(cb->strings);
+    free(cb);
+}
+
+int clua_callback_call(clua_callback* cb, void* ret, ...)
+{
+    callback_value args[CLUA_CALLBACK_MAX_ARGS];
+    va_list ap;
+    va_start(ap, ret);
+    read_args(cb, args, ap);
+    va_end(ap);
+
+    callback_batch batch = { cb, args, ret, 0 };
+    return callback_run(cb, &batch);
+}
+
+const char* clua_callback_error(const clua_callback* cb)
+{
+    if(!cb->failed)
+        return NULL;
+    lua_rawgeti(cb->L, LUA_REGISTRYINDEX, cb->anchor);
+    const char* msg = lua_tostring(cb->L, -1);
+    lua_pop(cb->L, 1);
+    return msg != NULL ? msg : "(error object is not a string)";
+}
+
+/**
+ * @brief 将字符串复制到队列的字符串区
+ * @return 偏移, 内存不足时返回 NO_STRING
+ */
+static size_t queue_string(clua_callback* cb, const char* data, size_t len)
+{
+    if(cb->strings_len + len + 1 > cb->strings_cap)
+    {
+        size_t cap = cb->strings_cap > 0 ? cb->strings_cap * 2 : 256;
+        while(cap < cb->strings_len + len + 1)
+            cap *= 2;
+        char* strings = (char*)realloc(cb->strings, cap);
+        if(strings == NULL)
+            return NO_STRING;
+        cb->strings = strings;
+        cb->strings_cap = cap;
+    }
+    size_t offset = cb->strings_len;
+    memcpy(cb->strings + offset, data, len);
+    cb->strings[offset + len] = '\0';
+    cb->strings_len += len + 1;
+    return offset;
+}
+
+int clua_callback_push(clua_callback* cb, ...)
+{
+    if(cb->count == cb->capacity)
+    {
+        size_t capacity = cb->capacity > 0 ? cb->capacity * 2 : 16;
+        size_t size = capacity * (size_t)(cb->nargs > 0 ? cb->nargs : 1) * sizeof(callback_value);
+        callback_value* queue = (callback_value*)realloc(cb->queue, size);
+        if(queue == NULL)
+            return 0;
+        cb->queue = queue;
+        cb->capacity = capacity;
+    }
+
+    callback_value* args = cb->queue + cb->count * (size_t)cb->nargs;
+    va_list ap;
+    va_start(ap, cb);
+    read_args(cb, args, ap);
+    va_end(ap);
+
+    for(int i = 0; i < cb->nargs; ++i)
+    {
+        callback_value* value = &args[i];
+        if(cb->fmt[i + 1] == 's' && value->s != NULL)
+        {
+            size_t offset = queue_string(cb, value->s, strlen(value->s));
+            if(offset == NO_STRING)
+                return 0;
+            value->U = offset;
+        }
+        else if(cb->fmt[i + 1] == 's')
+        {
+            value->U = NO_STRING;
+        }
+        else if(cb->fmt[i + 1] == 'b')
+        {
+            size_t offset = queue_string(cb, value->b.data, value->b.len);
+            if(offset == NO_STRING)
+                return 0;
+            value->b.data = (const char*)(uintptr_t)offset;
+        }
+    }
+    ++cb->count;
+    return 1;
+}
+
+size_t clua_callback_pending(const clua_callback* cb)
+{
+    return cb->count;
+}
+
+int clua_callback_flush(clua_callback* cb)
+{
+    if(cb->flushing || cb->count == 0)
+        return 0;
+
+    cb->flushing = 1;
+    callback_batch batch = { cb, NULL, NULL, 0 };
+    int status = callback_run(cb, &batch);
+    cb->flushing = 0;
+
+    size_t done = status != 0 ? batch.done + 1 : batch.done;
+    size_t nargs = (size_t)cb->nargs;
+    memmove(cb->queue, cb->queue + done * nargs,
+            (cb->count - done) * nargs * sizeof(callback_value));
+    cb->count -= done;
+    if(cb->count == 0)
+        cb->strings_len = 0;
+    return status;
+}
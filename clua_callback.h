@@ -0,0 +1,88 @@
+/**
+ * @file clua_callback.h
+ * @brief 从C调用lua函数
+ *
+ * lua函数在创建回调时解析一次并保存在注册表中, 之后每次调用直接按引用取出, 不再按名字查找全局变量.
+ * 参数和返回值的类型用与 lua_set_value/lua_get_value 相同的类型列表描述. 调用通过预先创建的
+ * 错误处理函数和调用函数完成, 失败时才生成调用栈信息. 事件可以先放入队列, 再在一次保护调用中
+ * 依次传给lua函数
+ */
+#ifndef CLUA_CALLBACK_H
+#define CLUA_CALLBACK_H
+
+#include "luabinding.h"
+
+/**
+ * @brief 回调参数个数上限
+ */
+#define CLUA_CALLBACK_MAX_ARGS 16
+
+typedef struct clua_callback clua_callback;
+
+/**
+ * @brief 创建回调
+ * @param L lua状态机, 回调只能在该状态机所在的线程中使用
+ * @param index lua函数在堆栈中的位置
+ * @param fmt 返回值+参数类型列表, 同 CLUA_DEF, 支持 'v' 'd' 'u' 'f' 'D' 'U' 'F' 's' 'p' 'b' 'B'
+ *            'x' 'X' 'i' 'I', 会被复制
+ * @return 不是函数或类型列表不支持时返回NULL
+ *
+ * @note 示例
+ * clua_callback* cb = clua_callback_global(L, "on_hit", "dsd");
+ * int damage;
+ * if(clua_callback_call(cb, &damage, "orc", 10) != 0)
+ *     fprintf(stderr, "%s\n", clua_callback_error(cb));
+ */
+clua_callback* clua_callback_new(lua_State* L, int index, const char* fmt);
+
+/**
+ * @brief 按名字取全局函数创建回调, 参数同 @ref clua_callback_new
+ */
+clua_callback* clua_callback_global(lua_State* L, const char* name, const char* fmt);
+
+/**
+ * @brief 释放回调, 丢弃队列中未传递的事件
+ * @param cb 回调
+ */
+void clua_callback_free(clua_callback* cb);
+
+/**
+ * @brief 调用lua函数
+ * @param cb 回调
+ * @param ret 返回值输出指针, 类型见 @ref lua_get_value, 可为NULL. 's' 'b' 'B' 等指向lua内存的返回值
+ *            在下一次调用该回调之前有效
+ * @param ... 参数, 与类型列表一一对应, 'f' 按 double 传入
+ * @return lua状态码, 失败时可用 @ref clua_callback_error 获取错误信息
+ */
+int clua_callback_call(clua_callback* cb, void* ret, ...);
+
+/**
+ * @brief 获取最近一次调用的错误信息, 带调用栈
+ * @param cb 回调
+ * @return 最近一次调用成功时返回NULL, 在下一次调用该回调之前有效
+ */
+const char* clua_callback_error(const clua_callback* cb);
+
+/**
+ * @brief 将一个事件放入队列, 等待 @ref clua_callback_flush 传递
+ * @param cb 回调
+ * @param ... 参数, 同 @ref clua_callback_call. 's' 'b' 的内容会被复制, 其它指针参数在传递前必须有效
+ * @return 内存不足时返回0
+ */
+int clua_callback_push(clua_callback* cb, ...);
+
+/**
+ * @brief 获取队列中的事件数
+ * @param cb 回调
+ */
+size_t clua_callback_pending(const clua_callback* cb);
+
+/**
+ * @brief 在一次保护调用中按顺序将队列中的事件传给lua函数, 忽略返回值
+ * @param cb 回调
+ * @return lua状态码. 失败时出错的事件被丢弃, 之后的事件留在队列中
+ * @note lua函数中放入队列的事件在本次传递中一并传递
+ */
+int clua_callback_flush(clua_callback* cb);
+
+#endif // CLUA_CALLBACK_H
@@ -0,0 +1,207 @@
+#include "clua_gc.h"
+#include <stdlib.h>
+#include <time.h>
+
+#define DEFAULT_BUDGET_NS 1000000
+#define RATE_SMOOTH 0.2
+
+struct clua_gc
+{
+    lua_State* L;
+    long budget_ns;
+    int steps;
+    int step_kb;
+    size_t limit;
+    int depth;                  ///< 关键区嵌套深度
+    size_t last_kb;             ///< 上一次回收结束时的内存
+    size_t alloc_kb;            ///< 上一次 tick 以来分配的内存
+    unsigned long long last_ns; ///< 上一次 tick 的时间
+    clua_gc_stat stat;
+};
+
+static unsigned long long now_ns(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (unsigned long long)ts.tv_sec * 1000000000ull + (unsigned long long)ts.tv_nsec;
+}
+
+static size_t count_kb(lua_State* L)
+{
+    return (size_t)lua_gc(L, LUA_GCCOUNT, 0);
+}
+
+/**
+ * @brief 自动回收已停止, 两次回收之间内存只增不减, 增量即为分配量
+ */
+static void account(clua_gc* gc)
+{
+    size_t kb = count_kb(gc->L);
+    if(kb > gc->last_kb)
+        gc->alloc_kb += kb - gc->last_kb;
+    gc->last_kb = kb;
+}
+
+static void record(clua_gc* gc, unsigned long long ns)
+{
+    clua_gc_stat* stat = &gc->stat;
+    ++stat->ticks;
+    stat->total_ns += ns;
+    if(ns > stat->max_ns)
+        stat->max_ns = ns;
+
+    unsigned long long us = ns / 1000;
+    int i = 0;
+    while(us >= 2 && i < CLUA_GC_BUCKETS - 1)
+    {
+        us >>= 1;
+        ++i;
+    }
+    ++stat->hist[i];
+}
+
+/**
+ * @brief 分步回收, 完成一个周期或超出预算时返回
+ * @param budget_ns 时间预算, 0表示不限制
+ * @param steps 步数预算, 0表示不限制
+ */
+static int collect(clua_gc* gc, long budget_ns, int steps)
+{
+    lua_State* L = gc->L;
+    unsigned long long start = now_ns();
+    unsigned long long end;
+    int done = 0;
+    for(int n = 1;; ++n)
+    {
+        done = lua_gc(L, LUA_GCSTEP, gc->step_kb);
+        ++gc->stat.steps;
+        end = now_ns();
+        if(done || (budget_ns > 0 && end - start >= (unsigned long long)budget_ns) ||
+           (steps > 0 && n >= steps))
+            break;
+    }
+    /* LUA_GCSTEP 会重新设置回收阈值, 恢复自动回收, 需要再次停止 */
+    lua_gc(L, LUA_GCSTOP, 0);
+
+    if(done)
+        ++gc->stat.cycles;
+    record(gc, end - start);
+    gc->last_kb = count_kb(L);
+    return done;
+}
+
+clua_gc* clua_gc_create(lua_State* L)
+{
+    clua_gc* gc = (clua_gc*)calloc(1, sizeof(clua_gc));
+    if(gc == NULL)
+        return NULL;
+    gc->L = L;
+    gc->budget_ns = DEFAULT_BUDGET_NS;
+    lua_gc(L, LUA_GCSTOP, 0);
+    gc->last_kb = count_kb(L);
+    gc->last_ns = now_ns();
+    return gc;
+}
+
+void clua_gc_destroy(clua_gc* gc)
+{
+    lua_gc(gc->L, LUA_GCRESTART, 0);
+    free(gc);
+}
+
+void clua_gc_set_budget(clua_gc* gc, long budget_ns, int steps, int step_kb)
+{
+    gc->budget_ns = budget_ns > 0 ? budget_ns : 0;
+    gc->steps = steps > 0 ? steps : 0;
+    gc->step_kb = step_kb > 0 ? step_kb : 0;
+}
+
+void clua_gc_set_limit(clua_gc* gc, size_t kbytes)
+{
+    gc->limit = kbytes;
+}
+
+int clua_gc_tick(clua_gc* gc)
+{
+    account(gc);
+    unsigned long long now = now_ns();
+    if(now > gc->last_ns)
+    {
+        double rate = (double)gc->alloc_kb * 1e9 / (double)(now - gc->last_ns);
+        if(gc->stat.alloc_rate == 0)
+            gc->stat.alloc_rate = rate;
+        else
+            gc->stat.alloc_rate += (rate - gc->stat.alloc_rate) * RATE_SMOOTH;
+        gc->alloc_kb = 0;
+        gc->last_ns = now;
+    }
+
+    if(gc->depth > 0)
+    {
+        ++gc->stat.deferred;
+        return 0;
+    }
+    if(gc->limit > 0 && gc->last_kb > gc->limit)
+        return collect(gc, 0, 0);
+    return collect(gc, gc->budget_ns, gc->steps);
+}
+
+int clua_gc_idle(clua_gc* gc, long ns)
+{
+    account(gc);
+    if(gc->depth > 0)
+    {
+        ++gc->stat.deferred;
+        return 0;
+    }
+    if(ns <= 0)
+        return 0;
+    return collect(gc, ns, 0);
+}
+
+void clua_gc_enter(clua_gc* gc)
+{
+    ++gc->depth;
+}
+
+void clua_gc_leave(clua_gc* gc)
+{
+    if(gc->depth > 0)
+        --gc->depth;
+}
+
+void clua_gc_get_stat(const clua_gc* gc, clua_gc_stat* stat)
+{
+    *stat = gc->stat;
+    stat->kbytes = count_kb(gc->L);
+}
+
+void clua_gc_reset_stat(clua_gc* gc)
+{
+    double rate = gc->stat.alloc_rate;
+    memset(&gc->stat, 0, sizeof(gc->stat));
+    gc->stat.alloc_rate = rate;
+}
+
+unsigned long long clua_gc_percentile(const clua_gc_stat* stat, double q)
+{
+    unsigned long long total = 0;
+    for(int i = 0; i < CLUA_GC_BUCKETS; ++i)
+    {
+        total += stat->hist[i];
+    }
+    if(total == 0)
+        return 0;
+
+    unsigned long long target = (unsigned long long)(q * (double)total);
+    if(target >= total)
+        target = total - 1;
+    unsigned long long seen = 0;
+    for(int i = 0; i < CLUA_GC_BUCKETS - 1; ++i)
+    {
+        seen += stat->hist[i];
+        if(seen > target)
+            return (2ull << i) * 1000;
+    }
+    return stat->max_ns;
+}
@@ -0,0 +1,117 @@
+/**
+ * @file clua_gc.h
+ * @brief lua垃圾回收调度
+ *
+ * 创建调度器后lua不再在分配内存时自动回收, 回收工作只在宿主调用 @ref clua_gc_tick 或
+ * @ref clua_gc_idle 时以 LUA_GCSTEP 分步执行, 每次执行的时间和步数受预算限制.
+ * 关键区内不执行回收, 回收被推迟到关键区之外. 调度器记录每次回收停顿的耗时分布和分配速率,
+ * 便于调整预算. 调度器只在所属状态机的线程中使用, 不加锁
+ */
+#ifndef CLUA_GC_H
+#define CLUA_GC_H
+
+#include "luabinding.h"
+
+/**
+ * @brief 停顿耗时分布的桶数, 第 i 个桶统计 [2^i, 2^(i+1)) 微秒的停顿, 第0个桶包含小于1微秒的停顿,
+ * 最后一个桶包含更长的停顿
+ */
+#define CLUA_GC_BUCKETS 16
+
+typedef struct clua_gc clua_gc;
+
+/**
+ * @brief 回收统计
+ */
+typedef struct clua_gc_stat
+{
+    unsigned long long ticks;              ///< 执行过回收的 tick/idle 次数
+    unsigned long long deferred;           ///< 因处于关键区而跳过的 tick/idle 次数
+    unsigned long long steps;              ///< LUA_GCSTEP 次数
+    unsigned long long cycles;             ///< 完成的回收周期数
+    unsigned long long total_ns;           ///< 回收总耗时
+    unsigned long long max_ns;             ///< 单次停顿的最大耗时
+    unsigned long long hist[CLUA_GC_BUCKETS]; ///< 停顿耗时分布
+    size_t kbytes;                         ///< lua当前使用的内存(KB)
+    double alloc_rate;                     ///< 分配速率(KB/s), 按 tick 间隔平滑
+} clua_gc_stat;
+
+/**
+ * @brief 创建调度器并停止lua的自动回收
+ * @param L lua状态机
+ * @return 失败时返回NULL
+ * @note 之后必须定期调用 @ref clua_gc_tick, 否则内存只增不减
+ */
+clua_gc* clua_gc_create(lua_State* L);
+
+/**
+ * @brief 销毁调度器并恢复lua的自动回收
+ * @param gc 调度器
+ */
+void clua_gc_destroy(clua_gc* gc);
+
+/**
+ * @brief 设置每次 tick 的回收预算, 两项都为0时每次 tick 完成一个回收周期
+ * @param gc 调度器
+ * @param budget_ns 时间预算(纳秒), 0表示不限制
+ * @param steps 步数预算, 0表示不限制
+ * @param step_kb 每步的工作量, 同 lua_gc(L, LUA_GCSTEP, step_kb)
+ */
+void clua_gc_set_budget(clua_gc* gc, long budget_ns, int steps, int step_kb);
+
+/**
+ * @brief 设置内存上限, 超过上限时 tick 忽略预算直到完成当前回收周期
+ * @param gc 调度器
+ * @param kbytes 内存上限(KB), 0表示不限制
+ */
+void clua_gc_set_limit(clua_gc* gc, size_t kbytes);
+
+/**
+ * @brief 每帧或每个请求结束时调用, 在预算内执行回收并更新分配速率
+ * @param gc 调度器
+ * @return 本次是否完成了一个回收周期
+ */
+int clua_gc_tick(clua_gc* gc);
+
+/**
+ * @brief 在空闲时间内执行回收, 完成一个回收周期或用完时间时返回
+ * @param gc 调度器
+ * @param ns 可用的空闲时间(纳秒)
+ * @return 本次是否完成了一个回收周期
+ */
+int clua_gc_idle(clua_gc* gc, long ns);
+
+/**
+ * @brief 进入关键区, 关键区内的 tick 和 idle 不执行回收, 可以嵌套
+ * @param gc 调度器
+ */
+void clua_gc_enter(clua_gc* gc);
+
+/**
+ * @brief 离开关键区
+ * @param gc 调度器
+ */
+void clua_gc_leave(clua_gc* gc);
+
+/**
+ * @brief 获取统计
+ * @param gc 调度器
+ * @param stat 输出统计
+ */
+void clua_gc_get_stat(const clua_gc* gc, clua_gc_stat* stat);
+
+/**
+ * @brief 将统计清零, 不影响分配速率
+ * @param gc 调度器
+ */
+void clua_gc_reset_stat(clua_gc* gc);
+
+/**
+ * @brief 按停顿耗时分布估算分位数
+ * @param stat 统计
+ * @param q 分位, 如 0.99
+ * @return 该分位所在桶的上界(纳秒), 没有停顿时返回0
+ */
+unsigned long long clua_gc_percentile(const clua_gc_stat* stat, double q);
+
+#endif // CLUA_GC_H
@@ -0,0 +1,405 @@
+#include "clua_pool.h"
+#include "clua_alloc.h"
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdlib.h>
+#include <unistd.h>
+
+struct clua_job
+{
+    clua_job* prev;
+    clua_job* next;
+    clua_job_fn fn;
+    void* arg;
+    clua_job_done done;
+    void* ud;
+    clua_job_push push; ///< clua_pool_call 的参数回调
+    void* push_arg;
+    char* name; ///< clua_pool_dofile 的路径或 clua_pool_call 的函数名
+    int status;
+    char* error;
+    atomic_int finished;
+    atomic_int refs; ///< 调用者和线程池各持有一个引用
+    clua_pool* pool;
+};
+
+/**
+ * @brief 工作线程, 任务队列两端分别供自身和其它线程使用:
+ * 自身从队尾取最近提交的任务, 窃取者从队头取最早提交的任务
+ */
+typedef struct worker
+{
+    _Alignas(CLUA_CACHE_LINE) pthread_mutex_t lock;
+    clua_job* head;
+    clua_job* tail;
+    clua_pool* pool;
+    clua_alloc* alloc; ///< 状态机独占的分配器, 小块分配不再经过malloc的全局锁
+    lua_State* L;
+    pthread_t thread;
+} worker;
+
+struct clua_pool
+{
+    int nthreads;
+    worker* workers;
+    clua_pool_init init;
+    void* ud;
+    size_t mem_limit; ///< 每个状态机的内存上限
+    atomic_uint next;   ///< 轮流选择投递任务的工作线程
+    atomic_int pending; ///< 已提交但未被取走的任务数
+
+    pthread_mutex_t lock;
+    pthread_cond_t work_cond; ///< 有新任务或线程池停止
+    pthread_cond_t done_cond; ///< 有任务完成
+    int sleepers;             ///< 等待 work_cond 的线程数
+    int running;              ///< 已提交但未完成的任务数
+    int stop;
+};
+
+static _Thread_local worker* current_worker = NULL;
+
+static void job_release(clua_job* job)
+{
+    if(atomic_fetch_sub(&job->refs, 1) != 1)
+        return;
+    free(job->name);
+    free(job->error);
+    free(job);
+}
+
+static void worker_push(worker* w, clua_job* job)
+{
+    pthread_mutex_lock(&w->lock);
+    job->prev = w->tail;
+    job->next = NULL;
+    if(w->tail != NULL)
+        w->tail->next = job;
+    else
+        w->head = job;
+    w->tail = job;
+    pthread_mutex_unlock(&w->lock);
+}
+
+static clua_job* worker_pop(worker* w, int steal)
+{
+    pthread_mutex_lock(&w->lock);
+    clua_job* job = steal ? w->head : w->tail;
+    if(job != NULL)
+    {
+        if(job->prev != NULL)
+            job->prev->next = job->next;
+        else
+            w->head = job->next;
+        if(job->next != NULL)
+            job->next->prev = job->prev;
+        else
+            w->tail = job->prev;
+    }
+    pthread_mutex_unlock(&w->lock);
+    return job;
+}
+
+static clua_job* worker_take(worker* w)
+{
+    clua_pool* pool = w->pool;
+    clua_job* job = worker_pop(w, 0);
+    int self = (int)(w - pool->workers);
+    for(int i = 1; job == NULL && i < pool->nthreads; ++i)
+    {
+        job = worker_pop(&pool->workers[(self + i) % pool->nthreads], 1);
+    }
+    if(job != NULL)
+        atomic_fetch_sub(&pool->pending, 1);
+    return job;
+}
+
+static void worker_run(worker* w, clua_job* job)
+{
+    clua_pool* pool = w->pool;
+    lua_State* L = w->L;
+
+    job->status = job->fn(L, job->arg);
+    if(job->status != 0)
+    {
+        const char* msg = lua_tostring(L, -1);
+        job->error = strdup(msg != NULL ? msg : "(error object is not a string)");
+    }
+    if(job->done != NULL)
+        job->done(L, job->status, job->ud);
+    lua_settop(L, 0);
+
+    pthread_mutex_lock(&pool->lock);
+    atomic_store(&job->finished, 1);
+    --pool->running;
+    pthread_cond_broadcast(&pool->done_cond);
+    pthread_mutex_unlock(&pool->lock);
+    job_release(job);
+}
+
+static void* worker_main(void* arg)
+{
+    worker* w = (worker*)arg;
+    clua_pool* pool = w->pool;
+    current_worker = w;
+
+    for(;;)
+    {
+        clua_job* job = worker_take(w);
+        if(job != NULL)
+        {
+            worker_run(w, job);
+            continue;
+        }
+
+        pthread_mutex_lock(&pool->lock);
+        ++pool->sleepers;
+        while(atomic_load(&pool->pending) == 0 && !pool->stop)
+            pthread_cond_wait(&pool->work_cond, &pool->lock);
+        --pool->sleepers;
+        int stop = pool->stop && atomic_load(&pool->pending) == 0;
+        pthread_mutex_unlock(&pool->lock);
+        if(stop)
+            break;
+    }
+    return NULL;
+}
+
+static lua_State* worker_state(clua_pool* pool, worker* w)
+{
+    w->alloc = clua_alloc_create(pool->mem_limit, 0);
+    lua_State* L = clua_alloc_newstate(w->alloc);
+    if(L == NULL)
+    {
+        /* 64位 LuaJIT (非GC64) 不支持自定义分配器, 没有内存上限时退回默认分配器,
+         * 有上限时无法限制, 创建失败 */
+        clua_alloc_destroy(w->alloc);
+        w->alloc = NULL;
+        if(pool->mem_limit == 0)
+            L = luaL_newstate();
+    }
+    if(L == NULL)
+        return NULL;
+    luaL_openlibs(L);
+    luaopen_clua(L);
+    lua_settop(L, 0);
+    if(pool->init != NULL)
+        pool->init(L, pool->ud);
+    lua_settop(L, 0);
+    return L;
+}
+
+/**
+ * @brief 停止前 started 个工作线程并释放线程池
+ */
+static void pool_free(clua_pool* pool, int started)
+{
+    pthread_mutex_lock(&pool->lock);
+    pool->stop = 1;
+    pthread_cond_broadcast(&pool->work_cond);
+    pthread_mutex_unlock(&pool->lock);
+
+    for(int i = 0; i < pool->nthreads; ++i)
+    {
+        worker* w = &pool->workers[i];
+        if(i < started)
+            pthread_join(w->thread, NULL);
+        lua_close(w->L);
+        clua_alloc_destroy(w->alloc);
+        pthread_mutex_destroy(&w->lock);
+    }
+    pthread_mutex_destroy(&pool->lock);
+    pthread_cond_destroy(&pool->work_cond);
+    pthread_cond_destroy(&pool->done_cond);
+    free(pool->workers);
+    free(pool);
+}
+
+clua_pool* clua_pool_create(int nthreads, size_t mem_limit, clua_pool_init init, void* ud)
+{
+    if(nthreads <= 0)
+        nthreads = (int)sysconf(_SC_NPROCESSORS_ONLN);
+    if(nthreads <= 0)
+        nthreads = 1;
+
+    clua_pool* pool = (clua_pool*)calloc(1, sizeof(clua_pool));
+    if(pool == NULL)
+        return NULL;
+    pool->workers = (worker*)aligned_alloc(CLUA_CACHE_LINE, sizeof(worker) * (size_t)nthreads);
+    if(pool->workers == NULL)
+    {
+        free(pool);
+        return NULL;
+    }
+    pool->init = init;
+    pool->ud = ud;
+    pool->mem_limit = mem_limit;
+    atomic_init(&pool->next, 0);
+    atomic_init(&pool->pending, 0);
+    pthread_mutex_init(&pool->lock, NULL);
+    pthread_cond_init(&pool->work_cond, NULL);
+    pthread_cond_init(&pool->done_cond, NULL);
+
+    /* 状态机在主线程中依次创建, 初始化回调不需要考虑线程安全 */
+    for(int i = 0; i < nthreads; ++i)
+    {
+        worker* w = &pool->workers[i];
+        memset(w, 0, sizeof(worker));
+        pthread_mutex_init(&w->lock, NULL);
+        w->pool = pool;
+        w->L = worker_state(pool, w);
+        if(w->L == NULL)
+        {
+            pthread_mutex_destroy(&w->lock);
+            break;
+        }
+        pool->nthreads = i + 1;
+    }
+    if(pool->nthreads < nthreads)
+    {
+        pool_free(pool, 0);
+        return NULL;
+    }
+
+    for(int i = 0; i < nthreads; ++i)
+    {
+        if(pthread_create(&pool->workers[i].thread, NULL, worker_main, &pool->workers[i]) != 0)
+        {
+            pool_free(pool, i);
+            return NULL;
+        }
+    }
+    return pool;
+}
+
+void clua_pool_destroy(clua_pool* pool)
+{
+    pthread_mutex_lock(&pool->lock);
+    while(pool->running > 0)
+        pthread_cond_wait(&pool->done_cond, &pool->lock);
+    pthread_mutex_unlock(&pool->lock);
+    pool_free(pool, pool->nthreads);
+}
+
+int clua_pool_size(const clua_pool* pool)
+{
+    return pool->nthreads;
+}
+
+static clua_job* job_new(clua_job_fn fn, void* arg, clua_job_done done, void* ud)
+{
+    clua_job* job = (clua_job*)calloc(1, sizeof(clua_job));
+    if(job == NULL)
+        return NULL;
+    job->fn = fn;
+    job->arg = arg;
+    job->done = done;
+    job->ud = ud;
+    atomic_init(&job->finished, 0);
+    atomic_init(&job->refs, 2);
+    return job;
+}
+
+static clua_job* pool_post(clua_pool* pool, clua_job* job)
+{
+    worker* w = current_worker;
+    job->pool = pool;
+    if(w == NULL || w->pool != pool)
+        w = &pool->workers[atomic_fetch_add(&pool->next, 1) % (unsigned)pool->nthreads];
+
+    pthread_mutex_lock(&pool->lock);
+    ++pool->running;
+    pthread_mutex_unlock(&pool->lock);
+
+    atomic_fetch_add(&pool->pending, 1);
+    worker_push(w, job);
+
+    pthread_mutex_lock(&pool->lock);
+    if(pool->sleepers > 0)
+        pthread_cond_signal(&pool->work_cond);
+    pthread_mutex_unlock(&pool->lock);
+    return job;
+}
+
+clua_job* clua_pool_submit(clua_pool* pool, clua_job_fn fn, void* arg, clua_job_done done,
+                           void* ud)
+{
+    clua_job* job = job_new(fn, arg, done, ud);
+    if(job == NULL)
+        return NULL;
+    return pool_post(pool, job);
+}
+
+static int job_dofile(lua_State* L, void* arg)
+{
+    clua_job* job = (clua_job*)arg;
+    int status = luaL_loadfile(L, job->name);
+    if(status != 0)
+        return status;
+    return lua_pcall(L, 0, LUA_MULTRET, 0);
+}
+
+static int job_call(lua_State* L, void* arg)
+{
+    clua_job* job = (clua_job*)arg;
+    lua_getfield(L, LUA_GLOBALSINDEX, job->name);
+    if(!lua_isfunction(L, -1))
+    {
+        lua_pushfstring(L, "clua_pool_call failed! \"%s\" is not a function", job->name);
+        return LUA_ERRRUN;
+    }
+    int nargs = job->push != NULL ? job->push(L, job->push_arg) : 0;
+    return lua_pcall(L, nargs, LUA_MULTRET, 0);
+}
+
+clua_job* clua_pool_dofile(clua_pool* pool, const char* path, clua_job_done done, void* ud)
+{
+    clua_job* job = job_new(job_dofile, NULL, done, ud);
+    if(job == NULL)
+        return NULL;
+    job->arg = job;
+    job->name = strdup(path);
+    if(job->name == NULL)
+    {
+        free(job);
+        return NULL;
+    }
+    return pool_post(pool, job);
+}
+
+clua_job* clua_pool_call(clua_pool* pool, const char* func, clua_job_push push, void* arg,
+                         clua_job_done done, void* ud)
+{
+    clua_job* job = job_new(job_call, NULL, done, ud);
+    if(job == NULL)
+        return NULL;
+    job->arg = job;
+    job->name = strdup(func);
+    if(job->name == NULL)
+    {
+        free(job);
+        return NULL;
+    }
+    job->push = push;
+    job->push_arg = arg;
+    return pool_post(pool, job);
+}
+
+int clua_job_wait(clua_job* job)
+{
+    clua_pool* pool = job->pool;
+    pthread_mutex_lock(&pool->lock);
+    while(!atomic_load(&job->finished))
+        pthread_cond_wait(&pool->done_cond, &pool->lock);
+    pthread_mutex_unlock(&pool->lock);
+    return job->status;
+}
+
+const char* clua_job_error(const clua_job* job)
+{
+    return job->error;
+}
+
+void clua_job_free(clua_job* job)
+{
+    job_release(job);
+}
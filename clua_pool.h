@@ -0,0 +1,126 @@
+/**
+ * @file clua_pool.h
+ * @brief 多线程lua状态机池
+ *
+ * 每个工作线程持有一个独立的lua状态机, 状态机在线程启动时创建一次, 已注册 clua 库并执行用户的
+ * 初始化回调, 之后反复执行任务而不再重新初始化. 任务提交到各线程的任务队列中, 空闲线程会从其它
+ * 线程的队列中窃取任务
+ */
+#ifndef CLUA_POOL_H
+#define CLUA_POOL_H
+
+#include "luabinding.h"
+
+typedef struct clua_pool clua_pool;
+typedef struct clua_job clua_job;
+
+/**
+ * @brief 状态机初始化回调, 在工作线程中调用, 一般用于注册 CLUA_DEF 定义的接口
+ * @param L 工作线程的lua状态机, 已调用 luaL_openlibs 和 luaopen_clua
+ * @param ud 创建线程池时传入的用户数据
+ */
+typedef void (*clua_pool_init)(lua_State* L, void* ud);
+
+/**
+ * @brief 任务函数, 在工作线程中调用
+ * @param L 工作线程的lua状态机, 堆栈为空
+ * @param arg 提交任务时传入的参数
+ * @return lua状态码, 0表示成功, 失败时栈顶为错误信息
+ */
+typedef int (*clua_job_fn)(lua_State* L, void* arg);
+
+/**
+ * @brief 任务完成回调, 在工作线程中调用, 返回后堆栈会被清空
+ * @param L 工作线程的lua状态机, 堆栈上为任务的返回值或错误信息
+ * @param status lua状态码
+ * @param ud 提交任务时传入的用户数据
+ */
+typedef void (*clua_job_done)(lua_State* L, int status, void* ud);
+
+/**
+ * @brief 压入函数参数的回调, 用于 @ref clua_pool_call
+ * @param L 工作线程的lua状态机
+ * @param arg 提交任务时传入的参数
+ * @return 压入的参数个数
+ */
+typedef int (*clua_job_push)(lua_State* L, void* arg);
+
+/**
+ * @brief 创建线程池
+ * @param nthreads 工作线程数, 小于等于0时使用CPU核数
+ * @param mem_limit 每个状态机的内存上限(字节), 0表示不限制, 含义同 @ref clua_alloc_create
+ * @param init 状态机初始化回调, 可为NULL
+ * @param ud 传给 init 的用户数据
+ * @return 失败时返回NULL; mem_limit 不为0而无法使用自定义分配器时也返回NULL
+ */
+clua_pool* clua_pool_create(int nthreads, size_t mem_limit, clua_pool_init init, void* ud);
+
+/**
+ * @brief 等待所有已提交的任务完成后销毁线程池
+ * @param pool 线程池
+ */
+void clua_pool_destroy(clua_pool* pool);
+
+/**
+ * @brief 获取工作线程数
+ * @param pool 线程池
+ */
+int clua_pool_size(const clua_pool* pool);
+
+/**
+ * @brief 提交任务
+ * @param pool 线程池
+ * @param fn 任务函数
+ * @param arg 传给 fn 的参数
+ * @param done 完成回调, 可为NULL
+ * @param ud 传给 done 的用户数据
+ * @return 任务句柄, 调用者必须用 @ref clua_job_free 释放; 失败时返回NULL
+ */
+clua_job* clua_pool_submit(clua_pool* pool, clua_job_fn fn, void* arg, clua_job_done done,
+                           void* ud);
+
+/**
+ * @brief 提交执行脚本文件的任务, 脚本的返回值传给 done
+ * @param pool 线程池
+ * @param path 脚本路径, 会被复制
+ * @param done 完成回调, 可为NULL
+ * @param ud 传给 done 的用户数据
+ * @return 同 @ref clua_pool_submit
+ */
+clua_job* clua_pool_dofile(clua_pool* pool, const char* path, clua_job_done done, void* ud);
+
+/**
+ * @brief 提交调用全局lua函数的任务, 函数的返回值传给 done
+ * @param pool 线程池
+ * @param func 全局函数名, 会被复制
+ * @param push 压入参数的回调, 可为NULL
+ * @param arg 传给 push 的参数
+ * @param done 完成回调, 可为NULL
+ * @param ud 传给 done 的用户数据
+ * @return 同 @ref clua_pool_submit
+ */
+clua_job* clua_pool_call(clua_pool* pool, const char* func, clua_job_push push, void* arg,
+                         clua_job_done done, void* ud);
+
+/**
+ * @brief 等待任务完成
+ * @param job 任务句柄
+ * @return lua状态码
+ * @note 不要在同一线程池的工作线程中等待, 所有工作线程都在等待时会死锁
+ */
+int clua_job_wait(clua_job* job);
+
+/**
+ * @brief 获取已完成任务的错误信息
+ * @param job 任务句柄
+ * @return 成功时返回NULL
+ */
+const char* clua_job_error(const clua_job* job);
+
+/**
+ * @brief 释放任务句柄, 不需要等待任务完成
+ * @param job 任务句柄
+ */
+void clua_job_free(clua_job* job);
+
+#endif // CLUA_POOL_H
@@ -2,100 +2,1314 @@
 
 #define LUA_DO_ERROR(L, fmt, ...)                                                                  \
     lua_pushfstring(L, fmt, ##__VA_ARGS__);                                                        \
+    add_traceback(L, 1);                                                                           \
     lua_error(L)
 
-static const char* traceback(lua_State* L)
+/**
+ * @brief 将栈顶的错误信息替换为附加了调用栈的字符串, debug.traceback 不可用时保持不变
+ * @param level 调用栈起始层级, 同 debug.traceback
+ */
+static void add_traceback(lua_State* L, int level)
 {
     lua_getfield(L, LUA_GLOBALSINDEX, "debug");
+    if(!lua_istable(L, -1))
+    {
+        lua_pop(L, 1);
+        return;
+    }
     lua_getfield(L, -1, "traceback");
-    lua_pcall(L, 0, 1, 0);
-    return lua_tostring(L, -1);
+    lua_remove(L, -2);
+    if(!lua_isfunction(L, -1))
+    {
+        lua_pop(L, 1);
+        return;
+    }
+    lua_pushvalue(L, -2);
+    lua_pushinteger(L, level);
+    if(lua_pcall(L, 2, 1, 0) != 0)
+    {
+        lua_pop(L, 1);
+        return;
+    }
+    lua_replace(L, -2);
 }
 
-int lua_get_value(lua_State* L, int index, char type, void* value)
+/*******************
+ * clua_error
+ ******************/
+static char error_key;      ///< 注册表中错误模式的键, 为nil时抛出字符串
+static char error_meta_key; ///< 注册表中错误对象元表的键
+
+static const char* type_name(char type)
 {
     switch(type)
     {
     case 'd':
+        return "int";
     case 'u':
-        if(lua_isnumber(L, index))
-            *((int*)value) = (int)lua_tointeger(L, index);
-        else if(lua_isboolean(L, index))
-            *((int*)value) = lua_toboolean(L, index);
-        else
-            goto fail;
-        break;
+        return "unsigned";
     case 'f':
-        if(!lua_isnumber(L, index))
-            goto fail;
-        *((float*)value) = (float)lua_tonumber(L, index);
-        break;
+        return "float";
     case 'D':
+        return "long long";
     case 'U':
-        if(lua_isnumber(L, index))
-            *((long long*)value) = lua_tointeger(L, index);
-        else if(lua_isboolean(L, index))
-            *((long long*)value) = lua_toboolean(L, index);
-        else
-            goto fail;
-        break;
+        return "unsigned long long";
     case 'F':
-        if(!lua_isnumber(L, index))
-            goto fail;
-        *((double*)value) = lua_tonumber(L, index);
-        break;
+        return "double";
     case 's':
-        if(!lua_isstring(L, index))
-            goto fail;
-        *((const char**)value) = lua_tostring(L, index);
-        break;
+    case 'S':
+        return "const char*";
     case 'p':
-        if(!lua_isuserdata(L, index))
-            goto fail;
-        *((const void**)value) = lua_topointer(L, index);
-        break;
+    case 'P':
+        return "void*";
+    case 'b':
+        return "clua_buffer";
+    case 'B':
+        return "clua_bytes*";
+    case 'x':
+        return "clua_floats";
+    case 'X':
+        return "clua_doubles";
+    case 'i':
+        return "clua_int32s";
+    case 'I':
+        return "clua_int64s";
+    case 'T':
+        return "struct";
+    case 'O':
+        return "object";
     default:
-        goto fail;
+        return "?";
+    }
+}
+
+_Thread_local clua_element clua_element_current = { 0, 0, NULL };
+
+/**
+ * @brief 取出并清零正在转换的数组元素或结构体字段
+ * @return 出错的值不是栈顶的临时值或不在转换数组元素和结构体字段时, 返回的 index 为0
+ */
+static clua_element take_element(int index)
+{
+    clua_element element = clua_element_current;
+    clua_element_current = (clua_element){ 0, 0, NULL };
+    if(index >= 0 || index <= LUA_REGISTRYINDEX)
+        element = (clua_element){ 0, 0, NULL };
+    return element;
+}
+
+/**
+ * @brief 开启了 CLUA_ERROR_OBJECT 时创建错误对象并抛出, 否则返回
+ *
+ * 每次出错创建一个新的错误对象, 已被脚本保留的错误不会被之后的错误改写.
+ * 只读取调用处的函数名和行号, 都复制到错误对象中, 不格式化字符串
+ * @param element 出错的数组元素或结构体字段, index 为0时 index 参数即为参数位置
+ */
+static void raise_error(lua_State* L, int index, const clua_element* element,
+                        const char* expected, const char* actual)
+{
+    lua_pushlightuserdata(L, &error_key);
+    lua_rawget(L, LUA_REGISTRYINDEX);
+    int enabled = lua_toboolean(L, -1);
+    lua_pop(L, 1);
+    if(!enabled)
+        return;
+
+    clua_error* err = (clua_error*)lua_newuserdata(L, sizeof(clua_error));
+    lua_pushlightuserdata(L, &error_meta_key);
+    lua_rawget(L, LUA_REGISTRYINDEX);
+    lua_setmetatable(L, -2);
+
+    lua_Debug ar;
+    err->index = element->index != 0 ? element->index : index;
+    err->element = element->k;
+    err->field = element->field;
+    err->expected = expected;
+    err->actual = actual;
+    strcpy(err->name, "?");
+    if(lua_getstack(L, 0, &ar) && lua_getinfo(L, "n", &ar) && ar.name != NULL)
+    {
+        strncpy(err->name, ar.name, sizeof(err->name) - 1);
+        err->name[sizeof(err->name) - 1] = '\0';
+        if(strcmp(ar.namewhat, "method") == 0)
+            --err->index;
+    }
+    err->source[0] = '\0';
+    err->line = -1;
+    if(lua_getstack(L, 1, &ar) && lua_getinfo(L, "Sl", &ar))
+    {
+        memcpy(err->source, ar.short_src, sizeof(err->source));
+        err->line = ar.currentline;
+    }
+    lua_error(L);
+}
+
+static int error_tostring(lua_State* L)
+{
+    const clua_error* err = lua_to_error(L, 1);
+    if(err == NULL)
+        return luaL_argerror(L, 1, "clua_error expected");
+    if(err->line >= 0)
+        lua_pushfstring(L, "%s:%d: ", err->source, err->line);
+    else
+        lua_pushliteral(L, "");
+    if(err->index == 0)
+        lua_pushfstring(L, "calling '%s' on bad self (%s expected, got %s)", err->name,
+                        err->expected, err->actual);
+    else if(err->field != NULL)
+        lua_pushfstring(L, "bad field '%s' in argument #%d to '%s' (%s expected, got %s)",
+                        err->field, err->index, err->name, err->expected, err->actual);
+    else if(err->element != 0)
+        lua_pushfstring(L, "bad element #%d in argument #%d to '%s' (%s expected, got %s)",
+                        err->element, err->index, err->name, err->expected, err->actual);
+    else
+        lua_pushfstring(L, "bad argument #%d to '%s' (%s expected, got %s)", err->index,
+                        err->name, err->expected, err->actual);
+    lua_concat(L, 2);
+    return 1;
+}
+
+static int error_index(lua_State* L)
+{
+    const clua_error* err = lua_to_error(L, 1);
+    const char* key = lua_tostring(L, 2);
+    if(err == NULL || key == NULL)
+        return 0;
+    if(strcmp(key, "name") == 0)
+        lua_pushstring(L, err->name);
+    else if(strcmp(key, "index") == 0)
+        lua_pushinteger(L, err->index);
+    else if(strcmp(key, "element") == 0 && err->element != 0)
+        lua_pushinteger(L, err->element);
+    else if(strcmp(key, "field") == 0 && err->field != NULL)
+        lua_pushstring(L, err->field);
+    else if(strcmp(key, "expected") == 0)
+        lua_pushstring(L, err->expected);
+    else if(strcmp(key, "actual") == 0)
+        lua_pushstring(L, err->actual);
+    else if(strcmp(key, "source") == 0)
+        lua_pushstring(L, err->source);
+    else if(strcmp(key, "line") == 0)
+        lua_pushinteger(L, err->line);
+    else
+        lua_pushnil(L);
+    return 1;
+}
+
+void lua_set_error_mode(lua_State* L, int mode)
+{
+    if(mode != CLUA_ERROR_OBJECT)
+    {
+        lua_pushlightuserdata(L, &error_key);
+        lua_pushnil(L);
+        lua_rawset(L, LUA_REGISTRYINDEX);
+        return;
+    }
+
+    lua_pushlightuserdata(L, &error_meta_key);
+    lua_rawget(L, LUA_REGISTRYINDEX);
+    if(!lua_istable(L, -1))
+    {
+        lua_pop(L, 1);
+        lua_createtable(L, 0, 2);
+        lua_pushcfunction(L, error_index);
+        lua_setfield(L, -2, "__index");
+        lua_pushcfunction(L, error_tostring);
+        lua_setfield(L, -2, "__tostring");
+        lua_pushlightuserdata(L, &error_meta_key);
+        lua_pushvalue(L, -2);
+        lua_rawset(L, LUA_REGISTRYINDEX);
+    }
+    lua_pop(L, 1);
+    lua_pushlightuserdata(L, &error_key);
+    lua_pushboolean(L, 1);
+    lua_rawset(L, LUA_REGISTRYINDEX);
+}
+
+const clua_error* lua_to_error(lua_State* L, int index)
+{
+    void* err = lua_touserdata(L, index);
+    if(err == NULL || lua_islightuserdata(L, index) || !lua_getmetatable(L, index))
+        return NULL;
+    lua_pushlightuserdata(L, &error_meta_key);
+    lua_rawget(L, LUA_REGISTRYINDEX);
+    int ok = lua_rawequal(L, -1, -2);
+    lua_pop(L, 2);
+    return ok ? (const clua_error*)err : NULL;
+}
+
+int lua_error_handler(lua_State* L)
+{
+    lua_settop(L, 1);
+    if(!lua_isstring(L, 1))
+    {
+        /* 没有 __tostring 的错误值原样返回 */
+        if(!luaL_callmeta(L, 1, "__tostring") || !lua_isstring(L, -1))
+            return 1;
+        lua_replace(L, 1);
     }
+    add_traceback(L, 2);
     return 1;
+}
 
-fail:
-    LUA_DO_ERROR(L, "lua_get_value failed! index=%d, c_type=%c, lua_type=\"%s\"\n %s", index, type,
-                 lua_typename(L, lua_type(L, index)), traceback(L));
+/**
+ * @brief 参数转换失败时计入当前接口的 failures, 每次调用只计一次
+ */
+static void count_failure(void)
+{
+#ifdef CLUA_STATS
+    clua_stat* stat = clua_stat_current;
+    if(stat != NULL)
+    {
+        atomic_fetch_add_explicit(&stat->failures, 1, memory_order_relaxed);
+        clua_stat_current = NULL;
+    }
+#endif
+}
+
+/**
+ * @brief 参数转换失败时抛出错误, 数组元素和结构体字段报告所在参数的位置
+ * @param c_type 期望的C类型, 用于错误字符串
+ */
+static int value_error(lua_State* L, int index, const char* c_type, const char* expected,
+                       const char* actual)
+{
+    count_failure();
+    clua_element element = take_element(index);
+    raise_error(L, index, &element, expected, actual);
+    int arg = element.index != 0 ? element.index : index;
+    if(element.field != NULL)
+    {
+        LUA_DO_ERROR(L, "lua_get_value failed! index=%d, field=%s, c_type=%s, lua_type=\"%s\"",
+                     arg, element.field, c_type, actual);
+    }
+    else if(element.k != 0)
+    {
+        LUA_DO_ERROR(L,
+                     "lua_get_value failed! index=%d, element=%d, c_type=%s, lua_type=\"%s\"",
+                     arg, element.k, c_type, actual);
+    }
+    LUA_DO_ERROR(L, "lua_get_value failed! index=%d, c_type=%s, lua_type=\"%s\"", arg, c_type,
+                 actual);
     return 0;
 }
 
-int lua_set_value(lua_State* L, char type, void* value)
+int lua_get_value_error(lua_State* L, int index, char type)
+{
+    const char* actual = lua_typename(L, lua_type(L, index));
+    if(lua_is_handle(L, index) && *(void**)lua_touserdata(L, index) == NULL)
+        actual = "released handle";
+    char c_type[2] = { type, '\0' };
+    return value_error(L, index, c_type, type_name(type), actual);
+}
+
+int lua_batch_prepare(lua_State* L, int nargs, int batchable, int* count)
+{
+    int arrays = 0;
+    int n = -1;
+    lua_settop(L, nargs);
+    for(int i = 1; i <= nargs; ++i)
+    {
+        if(!(batchable & (1 << (i - 1))) || !lua_istable(L, i))
+            continue;
+        int len = (int)lua_objlen(L, i);
+        if(n >= 0 && len != n)
+        {
+            count_failure();
+            LUA_DO_ERROR(L, "lua_batch failed! length mismatch, index=%d, len=%d, n=%d", i, len,
+                         n);
+        }
+        n = len;
+        arrays |= 1 << (i - 1);
+    }
+    if(n < 0)
+    {
+        count_failure();
+        LUA_DO_ERROR(L, "lua_batch failed! no array argument");
+    }
+    *count = n;
+    return arrays;
+}
+
+int lua_get_value(lua_State* L, int index, char type, void* value)
 {
     switch(type)
     {
     case 'd':
-        lua_pushnumber(L, *((int*)value));
+        *((int*)value) = lua_get_value_d(L, index);
         break;
     case 'u':
-        lua_pushnumber(L, *((unsigned*)value));
+        *((unsigned*)value) = lua_get_value_u(L, index);
         break;
     case 'f':
-        lua_pushnumber(L, (double)*((float*)value));
+        *((float*)value) = lua_get_value_f(L, index);
         break;
     case 'D':
-        lua_pushnumber(L, *(long long*)(value));
+        *((long long*)value) = lua_get_value_D(L, index);
         break;
     case 'U':
-        lua_pushnumber(L, *(unsigned long long*)(value));
+        *((unsigned long long*)value) = lua_get_value_U(L, index);
         break;
     case 'F':
-        lua_pushnumber(L, *(double*)(value));
+        *((double*)value) = lua_get_value_F(L, index);
         break;
     case 's':
-        lua_pushstring(L, *((const char**)value));
+    case 'S':
+        *((const char**)value) = lua_get_value_s(L, index);
         break;
     case 'p':
-        lua_pushlightuserdata(L, *((void**)value));
+    case 'P':
+        *((void**)value) = lua_get_value_p(L, index);
+        break;
+    case 'b':
+        *((clua_buffer*)value) = lua_get_value_b(L, index);
+        break;
+    case 'B':
+        *((clua_bytes**)value) = lua_get_value_B(L, index);
+        break;
+    case 'x':
+        *((clua_floats*)value) = lua_get_value_x(L, index);
         break;
+    case 'X':
+        *((clua_doubles*)value) = lua_get_value_X(L, index);
+        break;
+    case 'i':
+        *((clua_int32s*)value) = lua_get_value_i(L, index);
+        break;
+    case 'I':
+        *((clua_int64s*)value) = lua_get_value_I(L, index);
+        break;
+    default:
+        return lua_get_value_error(L, index, type);
+    }
+    return 1;
+}
+
+int lua_set_value(lua_State* L, char type, void* value)
+{
+    switch(type)
+    {
+    case 'd':
+        return lua_set_value_d(L, *((int*)value));
+    case 'u':
+        return lua_set_value_u(L, *((unsigned*)value));
+    case 'f':
+        return lua_set_value_f(L, *((float*)value));
+    case 'D':
+        return lua_set_value_D(L, *(long long*)(value));
+    case 'U':
+        return lua_set_value_U(L, *(unsigned long long*)(value));
+    case 'F':
+        return lua_set_value_F(L, *(double*)(value));
+    case 's':
+        return lua_set_value_s(L, *((const char**)value));
+    case 'S':
+        return lua_set_value_S(L, *((const char**)value));
+    case 'p':
+        return lua_set_value_p(L, *((void**)value));
+    case 'P':
+        return lua_set_value_P(L, *((void**)value));
+    case 'b':
+        return lua_set_value_b(L, *((clua_buffer*)value));
+    case 'B':
+        return lua_set_value_B(L, *((clua_bytes**)value));
+    case 'x':
+        return lua_set_value_x(L, *((clua_floats*)value));
+    case 'X':
+        return lua_set_value_X(L, *((clua_doubles*)value));
+    case 'i':
+        return lua_set_value_i(L, *((clua_int32s*)value));
+    case 'I':
+        return lua_set_value_I(L, *((clua_int64s*)value));
+    default:
+        LUA_DO_ERROR(L, "lua_set_value failed! c_type=%c", type);
+        return 0;
+    }
+}
+
+/*******************
+ * clua_stat
+ ******************/
+#ifdef CLUA_STATS
+static _Atomic(clua_stat*) stat_head = NULL;
+_Thread_local clua_stat* clua_stat_current = NULL;
+
+void clua_stat_register(clua_stat* stat)
+{
+    clua_stat* head = atomic_load(&stat_head);
+    do
+    {
+        stat->next = head;
+    } while(!atomic_compare_exchange_weak(&stat_head, &head, stat));
+}
+
+clua_stat* clua_stat_list(void)
+{
+    return atomic_load(&stat_head);
+}
+
+void clua_stat_reset(void)
+{
+    for(clua_stat* stat = clua_stat_list(); stat != NULL; stat = stat->next)
+    {
+        atomic_store_explicit(&stat->calls, 0, memory_order_relaxed);
+        atomic_store_explicit(&stat->completed, 0, memory_order_relaxed);
+        atomic_store_explicit(&stat->failures, 0, memory_order_relaxed);
+        atomic_store_explicit(&stat->total_ns, 0, memory_order_relaxed);
+        atomic_store_explicit(&stat->max_ns, 0, memory_order_relaxed);
+    }
+}
+#else
+clua_stat* clua_stat_list(void)
+{
+    return NULL;
+}
+
+void clua_stat_reset(void)
+{
+}
+#endif
+
+static int stats(lua_State* L)
+{
+    lua_newtable(L);
+#ifdef CLUA_STATS
+    for(clua_stat* stat = clua_stat_list(); stat != NULL; stat = stat->next)
+    {
+        lua_createtable(L, 0, 4);
+        lua_pushnumber(L, (lua_Number)atomic_load_explicit(&stat->calls, memory_order_relaxed));
+        lua_setfield(L, -2, "calls");
+        lua_pushnumber(L, (lua_Number)atomic_load_explicit(&stat->failures, memory_order_relaxed));
+        lua_setfield(L, -2, "failures");
+        lua_pushnumber(L, (lua_Number)atomic_load_explicit(&stat->total_ns, memory_order_relaxed));
+        lua_setfield(L, -2, "total_ns");
+        lua_pushnumber(L, (lua_Number)atomic_load_explicit(&stat->max_ns, memory_order_relaxed));
+        lua_setfield(L, -2, "max_ns");
+        lua_setfield(L, -2, stat->name);
+    }
+#endif
+    return 1;
+}
+
+static int stats_reset(lua_State* L)
+{
+    (void)L;
+    clua_stat_reset();
+    return 0;
+}
+
+/*******************
+ * clua_ffi
+ ******************/
+#ifdef CLUA_FFI
+static clua_ffi_decl* ffi_head = NULL;
+
+void clua_ffi_register(clua_ffi_decl* decl)
+{
+    decl->next = ffi_head;
+    ffi_head = decl;
+}
+
+/**
+ * @brief 是否可以通过ffi调用, ffi对这些类型的转换与 lua_get_value/lua_set_value 基本一致;
+ * 输出参数需要由接口压入, 不能直接调用
+ */
+static int ffi_supported(const clua_ffi_decl* decl)
+{
+    const char* fmt = decl->fmt;
+    if(fmt[0] == 's' || strchr(decl->args, '(') != NULL)
+        return 0;
+    for(const char* p = fmt; *p != '\0'; ++p)
+    {
+        if(strchr("vdufDUFs", *p) == NULL)
+            return 0;
+    }
+    return 1;
+}
+
+int lua_ffi_bind(lua_State* L, int index)
+{
+    if(index < 0 && index > LUA_REGISTRYINDEX)
+        index = lua_gettop(L) + index + 1;
+
+    lua_getfield(L, LUA_GLOBALSINDEX, "require");
+    lua_pushliteral(L, "ffi");
+    if(lua_pcall(L, 1, 1, 0) != 0)
+    {
+        lua_pop(L, 1);
+        return 0;
+    }
+    lua_getfield(L, -1, "cast");
+
+    int count = 0;
+    for(clua_ffi_decl* decl = ffi_head; decl != NULL; decl = decl->next)
+    {
+        if(!ffi_supported(decl))
+            continue;
+        lua_getfield(L, index, decl->name);
+        int registered = lua_tocfunction(L, -1) == decl->wrapper;
+        lua_pop(L, 1);
+        if(!registered)
+            continue;
+
+        lua_pushvalue(L, -1);
+        lua_pushfstring(L, "%s(*)(%s)", decl->fmt[0] == 'v' ? "void" : decl->ret,
+                        decl->args[0] != '\0' ? decl->args : "void");
+        lua_pushlightuserdata(L, decl->func);
+        if(lua_pcall(L, 2, 1, 0) != 0)
+        {
+            lua_pop(L, 1);
+            continue;
+        }
+        lua_setfield(L, index, decl->name);
+        ++count;
+    }
+    lua_pop(L, 2);
+    return count;
+}
+#else
+int lua_ffi_bind(lua_State* L, int index)
+{
+    (void)L;
+    (void)index;
+    return 0;
+}
+#endif
+
+/*******************
+ * clua_struct
+ ******************/
+void lua_push_struct_keys(lua_State* L, const clua_struct* desc)
+{
+    lua_pushlightuserdata(L, (void*)desc);
+    lua_rawget(L, LUA_REGISTRYINDEX);
+    if(!lua_isnil(L, -1))
+        return;
+    lua_pop(L, 1);
+
+    lua_createtable(L, desc->nfields, 0);
+    for(int i = 0; i < desc->nfields; ++i)
+    {
+        lua_pushstring(L, desc->fields[i].name);
+        lua_rawseti(L, -2, i + 1);
+    }
+    lua_pushlightuserdata(L, (void*)desc);
+    lua_pushvalue(L, -2);
+    lua_rawset(L, LUA_REGISTRYINDEX);
+}
+
+clua_element lua_enter_struct(lua_State* L, int index)
+{
+    clua_element saved = clua_element_current;
+    if(saved.index == 0)
+    {
+        if(index < 0 && index > LUA_REGISTRYINDEX)
+            index = lua_gettop(L) + index + 1;
+        clua_element_current = (clua_element){ index, 0, NULL };
+    }
+    return saved;
+}
+
+int lua_check_struct(lua_State* L, int index, const clua_struct* desc)
+{
+    /* 在转换为绝对位置之前检查, 嵌套结构体字段不是表时按 -1 报告为外层的字段 */
+    if(!lua_istable(L, index))
+        lua_get_value_error(L, index, 'T');
+    if(index < 0 && index > LUA_REGISTRYINDEX)
+        index = lua_gettop(L) + index + 1;
+    lua_push_struct_keys(L, desc);
+    return index;
+}
+
+int lua_get_struct(lua_State* L, int index, const clua_struct* desc, void* value)
+{
+    clua_element saved = lua_enter_struct(L, index);
+    index = lua_check_struct(L, index, desc);
+    for(int i = 0; i < desc->nfields; ++i)
+    {
+        const clua_struct_field* field = &desc->fields[i];
+        lua_rawgeti(L, -1, i + 1);
+        lua_rawget(L, index);
+        clua_element_current.field = field->name;
+        lua_get_value(L, -1, field->type, (char*)value + field->offset);
+        lua_pop(L, 1);
+    }
+    lua_pop(L, 1);
+    clua_element_current = saved;
+    return 1;
+}
+
+int lua_set_struct(lua_State* L, const clua_struct* desc, const void* value)
+{
+    lua_createtable(L, 0, desc->nfields);
+    lua_push_struct_keys(L, desc);
+    for(int i = 0; i < desc->nfields; ++i)
+    {
+        const clua_struct_field* field = &desc->fields[i];
+        lua_rawgeti(L, -1, i + 1);
+        lua_set_value(L, field->type, (char*)value + field->offset);
+        lua_rawset(L, -4);
+    }
+    lua_pop(L, 1);
+    return 1;
+}
+
+/*******************
+ * clua_object
+ ******************/
+static int object_gc(lua_State* L)
+{
+    clua_object* obj = (clua_object*)lua_touserdata(L, 1);
+    if(obj->ptr != NULL)
+    {
+        obj->cls->gc(obj->ptr);
+        obj->ptr = NULL;
+    }
+    return 0;
+}
+
+static int object_tostring(lua_State* L)
+{
+    clua_object* obj = (clua_object*)lua_touserdata(L, 1);
+    lua_pushfstring(L, "%s: %p", obj->cls->name, obj->ptr);
+    return 1;
+}
+
+void lua_register_class(lua_State* L, const clua_class* cls, const luaL_Reg* methods)
+{
+    lua_createtable(L, 0, 4);
+    int mt = lua_gettop(L);
+    lua_pushlightuserdata(L, (void*)cls);
+    lua_pushvalue(L, mt);
+    lua_rawset(L, LUA_REGISTRYINDEX);
+
+    lua_newtable(L);
+    for(; methods != NULL && methods->name != NULL; ++methods)
+    {
+        lua_pushvalue(L, mt);
+        lua_pushcclosure(L, methods->func, 1);
+        lua_setfield(L, -2, methods->name);
+    }
+    lua_pushvalue(L, -1);
+    lua_setfield(L, mt, "__index");
+    lua_pushcfunction(L, object_gc);
+    lua_setfield(L, mt, "__gc");
+    lua_pushcfunction(L, object_tostring);
+    lua_setfield(L, mt, "__tostring");
+    lua_remove(L, mt);
+}
+
+clua_object* lua_new_object(lua_State* L, const clua_class* cls, void* ptr)
+{
+    if(ptr == NULL)
+    {
+        lua_pushnil(L);
+        return NULL;
+    }
+    clua_object* obj = (clua_object*)lua_newuserdata(L, sizeof(clua_object));
+    obj->cls = cls;
+    obj->ptr = ptr;
+    lua_pushlightuserdata(L, (void*)cls);
+    lua_rawget(L, LUA_REGISTRYINDEX);
+    if(!lua_istable(L, -1))
+    {
+        obj->ptr = NULL;
+        cls->gc(ptr);
+        LUA_DO_ERROR(L, "lua_new_object failed! class %s is not registered", cls->name);
+    }
+    lua_setmetatable(L, -2);
+    return obj;
+}
+
+void* lua_to_object(lua_State* L, int index, const clua_class* cls)
+{
+    clua_object* obj = (clua_object*)lua_touserdata(L, index);
+    if(obj == NULL || !lua_getmetatable(L, index))
+        return NULL;
+    /* 方法闭包的上值为所属类型的元表, 一次指针比较即可确认是 clua_object;
+     * 其它情况再到注册表中取该类型的元表比较 */
+    int ok = lua_rawequal(L, -1, lua_upvalueindex(1));
+    if(!ok)
+    {
+        lua_pushlightuserdata(L, (void*)cls);
+        lua_rawget(L, LUA_REGISTRYINDEX);
+        ok = lua_rawequal(L, -1, -2);
+        lua_pop(L, 1);
+    }
+    lua_pop(L, 1);
+    return ok && obj->cls == cls ? obj->ptr : NULL;
+}
+
+int lua_object_error(lua_State* L, int index, const clua_class* cls)
+{
+    const char* actual = lua_typename(L, lua_type(L, index));
+    clua_object* obj = (clua_object*)lua_touserdata(L, index);
+    if(obj != NULL && lua_getmetatable(L, index))
+    {
+        lua_getfield(L, -1, "__gc");
+        if(lua_tocfunction(L, -1) == object_gc)
+            actual = obj->ptr != NULL ? obj->cls->name : "released object";
+        lua_pop(L, 2);
+    }
+    const char* c_type = lua_pushfstring(L, "%s*", cls->name);
+    return value_error(L, index, c_type, cls->name, actual);
+}
+
+/*******************
+ * clua_reg
+ ******************/
+void lua_register_funcs(lua_State* L, const clua_reg* regs)
+{
+    for(; regs->name != NULL; ++regs)
+    {
+        if(regs->target != NULL)
+        {
+            lua_pushlightuserdata(L, regs->target);
+            lua_pushcclosure(L, regs->func, 1);
+        }
+        else
+        {
+            lua_pushcfunction(L, regs->func);
+        }
+        lua_setfield(L, -2, regs->name);
+    }
+}
+
+/*******************
+ * clua_bytes
+ ******************/
+static char bytes_meta_key; ///< 注册表中 clua_bytes 元表的键
+
+clua_bytes* lua_new_bytes(lua_State* L, size_t len)
+{
+    if(len > SIZE_MAX - sizeof(clua_bytes))
+    {
+        LUA_DO_ERROR(L, "lua_new_bytes failed! len=%f", (lua_Number)len);
+    }
+    clua_bytes* bytes = (clua_bytes*)lua_newuserdata(L, sizeof(clua_bytes) + len);
+    bytes->data = (char*)(bytes + 1);
+    bytes->len = len;
+    memset(bytes->data, 0, len);
+    lua_pushlightuserdata(L, &bytes_meta_key);
+    lua_rawget(L, LUA_REGISTRYINDEX);
+    lua_setmetatable(L, -2);
+    return bytes;
+}
+
+clua_bytes* lua_to_bytes(lua_State* L, int index)
+{
+    clua_bytes* bytes = (clua_bytes*)lua_touserdata(L, index);
+    if(bytes == NULL || !lua_getmetatable(L, index))
+        return NULL;
+    lua_pushlightuserdata(L, &bytes_meta_key);
+    lua_rawget(L, LUA_REGISTRYINDEX);
+    if(!lua_rawequal(L, -1, -2))
+        bytes = NULL;
+    lua_pop(L, 2);
+    return bytes;
+}
+
+static clua_bytes* check_bytes(lua_State* L, int index)
+{
+    clua_bytes* bytes = lua_to_bytes(L, index);
+    if(bytes == NULL)
+        lua_get_value_error(L, index, 'B');
+    return bytes;
+}
+
+/**
+ * @brief 按 string.sub 的规则计算 [i, j] 范围
+ * @return 范围起始偏移, 长度写入 len
+ */
+static size_t bytes_range(lua_State* L, int index, size_t size, size_t* len)
+{
+    lua_Integer i = luaL_optinteger(L, index, 1);
+    lua_Integer j = luaL_optinteger(L, index + 1, -1);
+    if(i < 0)
+        i += (lua_Integer)size + 1;
+    if(j < 0)
+        j += (lua_Integer)size + 1;
+    if(i < 1)
+        i = 1;
+    if(j > (lua_Integer)size)
+        j = (lua_Integer)size;
+    *len = i > j ? 0 : (size_t)(j - i + 1);
+    return (size_t)(i - 1);
+}
+
+static int bytes_new(lua_State* L)
+{
+    if(lua_type(L, 1) == LUA_TSTRING)
+    {
+        size_t len;
+        const char* str = lua_tolstring(L, 1, &len);
+        memcpy(lua_new_bytes(L, len)->data, str, len);
+    }
+    else
+    {
+        lua_Integer len = luaL_checkinteger(L, 1);
+        luaL_argcheck(L, len >= 0, 1, "negative size");
+        lua_new_bytes(L, (size_t)len);
+    }
+    return 1;
+}
+
+static int bytes_len(lua_State* L)
+{
+    lua_pushinteger(L, (lua_Integer)check_bytes(L, 1)->len);
+    return 1;
+}
+
+static int bytes_sub(lua_State* L)
+{
+    clua_bytes* bytes = check_bytes(L, 1);
+    size_t len;
+    size_t offset = bytes_range(L, 2, bytes->len, &len);
+
+    clua_bytes* view = (clua_bytes*)lua_newuserdata(L, sizeof(clua_bytes));
+    view->data = bytes->data + offset;
+    view->len = len;
+    lua_getmetatable(L, 1);
+    lua_setmetatable(L, -2);
+    /* 切片的环境表引用原缓冲区, 保证其内存在切片存活期间有效 */
+    lua_createtable(L, 1, 0);
+    lua_pushvalue(L, 1);
+    lua_rawseti(L, -2, 1);
+    lua_setfenv(L, -2);
+    return 1;
+}
+
+static int bytes_tostring(lua_State* L)
+{
+    clua_bytes* bytes = check_bytes(L, 1);
+    size_t len;
+    size_t offset = bytes_range(L, 2, bytes->len, &len);
+    lua_pushlstring(L, bytes->data + offset, len);
+    return 1;
+}
+
+static int bytes_index(lua_State* L)
+{
+    clua_bytes* bytes = check_bytes(L, 1);
+    if(lua_type(L, 2) == LUA_TNUMBER)
+    {
+        lua_Integer i = lua_tointeger(L, 2);
+        if(i >= 1 && (size_t)i <= bytes->len)
+            lua_pushinteger(L, (unsigned char)bytes->data[i - 1]);
+        else
+            lua_pushnil(L);
+        return 1;
+    }
+    lua_pushvalue(L, 2);
+    lua_rawget(L, lua_upvalueindex(1));
+    return 1;
+}
+
+static int bytes_newindex(lua_State* L)
+{
+    clua_bytes* bytes = check_bytes(L, 1);
+    lua_Integer i = luaL_checkinteger(L, 2);
+    lua_Integer value = luaL_checkinteger(L, 3);
+    luaL_argcheck(L, i >= 1 && (size_t)i <= bytes->len, 2, "index out of range");
+    luaL_argcheck(L, value >= 0 && value <= 255, 3, "byte out of range");
+    bytes->data[i - 1] = (char)value;
+    return 0;
+}
+
+/*******************
+ * clua_handle
+ ******************/
+static char handle_meta_key;  ///< 注册表中 'P' userdata 元表的键
+static char handle_env_key;   ///< 注册表中空环境表的键, 表示userdata还没有附加字段
+static char handle_cache_key; ///< 注册表中 指针->userdata 弱值表的键
+static char string_cache_key; ///< 注册表中 指针->字符串 表的键
+
+/**
+ * @brief 取出缓存表, 第一次使用时创建
+ * @param mode 弱表模式, 为NULL时不是弱表
+ */
+static void push_cache(lua_State* L, void* key, const char* mode)
+{
+    lua_pushlightuserdata(L, key);
+    lua_rawget(L, LUA_REGISTRYINDEX);
+    if(lua_istable(L, -1))
+        return;
+    lua_pop(L, 1);
+
+    lua_newtable(L);
+    if(mode != NULL)
+    {
+        lua_createtable(L, 0, 1);
+        lua_pushstring(L, mode);
+        lua_setfield(L, -2, "__mode");
+        lua_setmetatable(L, -2);
+    }
+    lua_pushlightuserdata(L, key);
+    lua_pushvalue(L, -2);
+    lua_rawset(L, LUA_REGISTRYINDEX);
+}
+
+int lua_set_value_P(lua_State* L, const void* value)
+{
+    if(value == NULL)
+    {
+        lua_pushnil(L);
+        return 1;
+    }
+    push_cache(L, &handle_cache_key, "v");
+    lua_pushlightuserdata(L, (void*)value);
+    lua_rawget(L, -2);
+    if(lua_isnil(L, -1))
+    {
+        lua_pop(L, 1);
+        *(const void**)lua_newuserdata(L, sizeof(void*)) = value;
+        lua_pushlightuserdata(L, &handle_meta_key);
+        lua_rawget(L, LUA_REGISTRYINDEX);
+        lua_setmetatable(L, -2);
+        lua_pushlightuserdata(L, &handle_env_key);
+        lua_rawget(L, LUA_REGISTRYINDEX);
+        if(lua_istable(L, -1))
+            lua_setfenv(L, -2);
+        else
+            lua_pop(L, 1);
+        lua_pushlightuserdata(L, (void*)value);
+        lua_pushvalue(L, -2);
+        lua_rawset(L, -4);
+    }
+    lua_remove(L, -2);
+    return 1;
+}
+
+int lua_is_handle(lua_State* L, int index)
+{
+    if(lua_type(L, index) != LUA_TUSERDATA || !lua_getmetatable(L, index))
+        return 0;
+    lua_pushlightuserdata(L, &handle_meta_key);
+    lua_rawget(L, LUA_REGISTRYINDEX);
+    int ok = lua_rawequal(L, -1, -2);
+    lua_pop(L, 2);
+    return ok;
+}
+
+void* lua_to_handle(lua_State* L, int index)
+{
+    return lua_is_handle(L, index) ? *(void**)lua_touserdata(L, index) : NULL;
+}
+
+void lua_release_handle(lua_State* L, const void* ptr)
+{
+    push_cache(L, &handle_cache_key, "v");
+    lua_pushlightuserdata(L, (void*)ptr);
+    lua_rawget(L, -2);
+    if(lua_to_handle(L, -1) != NULL)
+        *(void**)lua_touserdata(L, -1) = NULL;
+    lua_pop(L, 1);
+    lua_pushlightuserdata(L, (void*)ptr);
+    lua_pushnil(L);
+    lua_rawset(L, -3);
+    lua_pop(L, 1);
+}
+
+int lua_set_value_S(lua_State* L, const char* value)
+{
+    if(value == NULL)
+    {
+        lua_pushnil(L);
+        return 1;
+    }
+    push_cache(L, &string_cache_key, NULL);
+    lua_pushlightuserdata(L, (void*)value);
+    lua_rawget(L, -2);
+    if(lua_isnil(L, -1))
+    {
+        lua_pop(L, 1);
+        lua_pushstring(L, value);
+        lua_pushlightuserdata(L, (void*)value);
+        lua_pushvalue(L, -2);
+        lua_rawset(L, -4);
+    }
+    lua_remove(L, -2);
+    return 1;
+}
+
+static int handle_index(lua_State* L)
+{
+    lua_getfenv(L, 1);
+    lua_pushvalue(L, 2);
+    lua_rawget(L, -2);
+    return 1;
+}
+
+/**
+ * @brief 第一次附加字段时才为userdata创建自己的环境表
+ */
+static int handle_newindex(lua_State* L)
+{
+    lua_getfenv(L, 1);
+    if(lua_rawequal(L, -1, lua_upvalueindex(1)))
+    {
+        lua_pop(L, 1);
+        lua_newtable(L);
+        lua_pushvalue(L, -1);
+        lua_setfenv(L, 1);
+    }
+    lua_pushvalue(L, 2);
+    lua_pushvalue(L, 3);
+    lua_rawset(L, -3);
+    return 0;
+}
+
+static int handle_tostring(lua_State* L)
+{
+    lua_pushfstring(L, "clua.handle: %p", *(void**)lua_touserdata(L, 1));
+    return 1;
+}
+
+/*******************
+ * clua_array
+ ******************/
+static char array_meta_key; ///< 注册表中 clua_array 元表的键
+
+static size_t array_elem_size(char type)
+{
+    switch(type)
+    {
+    case 'x':
+    case 'i':
+        return 4;
+    case 'X':
+    case 'I':
+        return 8;
     default:
-        LUA_DO_ERROR(L, "lua_set_value failed! c_type=%c\n %s", type, traceback(L));
         return 0;
     }
+}
+
+/**
+ * @brief 数组大小加上头部和对齐后不超过 SIZE_MAX 的最大元素个数
+ */
+static size_t array_max_len(char type)
+{
+    size_t elem = array_elem_size(type);
+    return elem != 0 ? (SIZE_MAX - sizeof(clua_array) - CLUA_ARRAY_ALIGN) / elem : 0;
+}
+
+clua_array* lua_new_array(lua_State* L, char type, size_t len)
+{
+    if(len > array_max_len(type))
+    {
+        LUA_DO_ERROR(L, "lua_new_array failed! type=%c, len=%f", type, (lua_Number)len);
+    }
+    size_t size = array_elem_size(type) * len;
+    clua_array* array =
+        (clua_array*)lua_newuserdata(L, sizeof(clua_array) + CLUA_ARRAY_ALIGN + size);
+    uintptr_t data = (uintptr_t)(array + 1);
+    data = (data + CLUA_ARRAY_ALIGN - 1) & ~(uintptr_t)(CLUA_ARRAY_ALIGN - 1);
+    array->data = (void*)data;
+    array->len = len;
+    array->type = type;
+    memset(array->data, 0, size);
+    lua_pushlightuserdata(L, &array_meta_key);
+    lua_rawget(L, LUA_REGISTRYINDEX);
+    lua_setmetatable(L, -2);
+    return array;
+}
+
+clua_array* lua_to_array(lua_State* L, int index, char type)
+{
+    clua_array* array = (clua_array*)lua_touserdata(L, index);
+    if(array == NULL || !lua_getmetatable(L, index))
+        return NULL;
+    lua_pushlightuserdata(L, &array_meta_key);
+    lua_rawget(L, LUA_REGISTRYINDEX);
+    if(!lua_rawequal(L, -1, -2) || (type != 0 && array->type != type))
+        array = NULL;
+    lua_pop(L, 2);
+    return array;
+}
+
+static clua_array* check_array(lua_State* L, int index)
+{
+    clua_array* array = lua_to_array(L, index, 0);
+    if(array == NULL)
+        luaL_typerror(L, index, "clua.array");
+    return array;
+}
+
+static void array_push(lua_State* L, const clua_array* array, size_t i)
+{
+    switch(array->type)
+    {
+    case 'x':
+        lua_pushnumber(L, ((float*)array->data)[i]);
+        break;
+    case 'X':
+        lua_pushnumber(L, ((double*)array->data)[i]);
+        break;
+    case 'i':
+        lua_pushnumber(L, ((int32_t*)array->data)[i]);
+        break;
+    case 'I':
+        lua_pushnumber(L, (lua_Number)((int64_t*)array->data)[i]);
+        break;
+    }
+}
+
+static void array_set(lua_State* L, clua_array* array, size_t i, int index)
+{
+    switch(array->type)
+    {
+    case 'x':
+        ((float*)array->data)[i] = (float)luaL_checknumber(L, index);
+        break;
+    case 'X':
+        ((double*)array->data)[i] = luaL_checknumber(L, index);
+        break;
+    case 'i':
+        ((int32_t*)array->data)[i] = (int32_t)luaL_checkinteger(L, index);
+        break;
+    case 'I':
+        ((int64_t*)array->data)[i] = (int64_t)luaL_checknumber(L, index);
+        break;
+    }
+}
+
+static int array_new(lua_State* L)
+{
+    static const char* const names[] = { "float", "double", "int32", "int64", NULL };
+    static const char types[] = { 'x', 'X', 'i', 'I' };
+    char type = types[luaL_checkoption(L, 1, NULL, names)];
+
+    if(lua_istable(L, 2))
+    {
+        size_t len = lua_objlen(L, 2);
+        clua_array* array = lua_new_array(L, type, len);
+        for(size_t i = 0; i < len; ++i)
+        {
+            lua_rawgeti(L, 2, (int)i + 1);
+            array_set(L, array, i, -1);
+            lua_pop(L, 1);
+        }
+    }
+    else
+    {
+        /* 先按浮点数检查范围, 过大的数转换为整数时会溢出 */
+        lua_Number len = luaL_checknumber(L, 2);
+        luaL_argcheck(L, len >= 0 && len <= (lua_Number)array_max_len(type), 2,
+                      "size out of range");
+        lua_new_array(L, type, (size_t)len);
+    }
+    return 1;
+}
+
+static int array_len(lua_State* L)
+{
+    lua_pushinteger(L, (lua_Integer)check_array(L, 1)->len);
+    return 1;
+}
+
+static int array_totable(lua_State* L)
+{
+    clua_array* array = check_array(L, 1);
+    lua_createtable(L, (int)array->len, 0);
+    for(size_t i = 0; i < array->len; ++i)
+    {
+        array_push(L, array, i);
+        lua_rawseti(L, -2, (int)i + 1);
+    }
+    return 1;
+}
+
+static int array_index(lua_State* L)
+{
+    clua_array* array = check_array(L, 1);
+    if(lua_type(L, 2) == LUA_TNUMBER)
+    {
+        lua_Integer i = lua_tointeger(L, 2);
+        if(i >= 1 && (size_t)i <= array->len)
+            array_push(L, array, (size_t)i - 1);
+        else
+            lua_pushnil(L);
+        return 1;
+    }
+    lua_pushvalue(L, 2);
+    lua_rawget(L, lua_upvalueindex(1));
+    return 1;
+}
+
+static int array_newindex(lua_State* L)
+{
+    clua_array* array = check_array(L, 1);
+    lua_Integer i = luaL_checkinteger(L, 2);
+    luaL_argcheck(L, i >= 1 && (size_t)i <= array->len, 2, "index out of range");
+    array_set(L, array, (size_t)i - 1, 3);
+    return 0;
+}
+
+int luaopen_clua(lua_State* L)
+{
+    static const luaL_Reg bytes_methods[] = {
+        { "len", bytes_len },
+        { "sub", bytes_sub },
+        { "tostring", bytes_tostring },
+        { NULL, NULL }
+    };
+    static const luaL_Reg array_methods[] = {
+        { "len", array_len },
+        { "totable", array_totable },
+        { NULL, NULL }
+    };
+    static const luaL_Reg clua_lib[] = {
+        { "bytes", bytes_new },
+        { "array", array_new },
+        { "stats", stats },
+        { "stats_reset", stats_reset },
+        { "traceback", lua_error_handler },
+        { NULL, NULL }
+    };
+
+    lua_pushlightuserdata(L, &bytes_meta_key);
+    lua_createtable(L, 0, 4);
+    lua_newtable(L);
+    luaL_register(L, NULL, bytes_methods);
+    lua_pushcclosure(L, bytes_index, 1);
+    lua_setfield(L, -2, "__index");
+    lua_pushcfunction(L, bytes_newindex);
+    lua_setfield(L, -2, "__newindex");
+    lua_pushcfunction(L, bytes_len);
+    lua_setfield(L, -2, "__len");
+    lua_pushcfunction(L, bytes_tostring);
+    lua_setfield(L, -2, "__tostring");
+    lua_rawset(L, LUA_REGISTRYINDEX);
+
+    lua_pushlightuserdata(L, &array_meta_key);
+    lua_createtable(L, 0, 3);
+    lua_newtable(L);
+    luaL_register(L, NULL, array_methods);
+    lua_pushcclosure(L, array_index, 1);
+    lua_setfield(L, -2, "__index");
+    lua_pushcfunction(L, array_newindex);
+    lua_setfield(L, -2, "__newindex");
+    lua_pushcfunction(L, array_len);
+    lua_setfield(L, -2, "__len");
+    lua_rawset(L, LUA_REGISTRYINDEX);
+
+    lua_pushlightuserdata(L, &handle_env_key);
+    lua_newtable(L);
+    lua_rawset(L, LUA_REGISTRYINDEX);
+
+    lua_pushlightuserdata(L, &handle_meta_key);
+    lua_createtable(L, 0, 3);
+    lua_pushcfunction(L, handle_index);
+    lua_setfield(L, -2, "__index");
+    lua_pushlightuserdata(L, &handle_env_key);
+    lua_rawget(L, LUA_REGISTRYINDEX);
+    lua_pushcclosure(L, handle_newindex, 1);
+    lua_setfield(L, -2, "__newindex");
+    lua_pushcfunction(L, handle_tostring);
+    lua_setfield(L, -2, "__tostring");
+    lua_rawset(L, LUA_REGISTRYINDEX);
+
+    luaL_register(L, "clua", clua_lib);
     return 1;
 }
@@ -8,6 +8,81 @@
 #include "lauxlib.h"
 #include "lua.h"
 #include "lualib.h"
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+
+#ifdef CLUA_STATS
+#include <stdatomic.h>
+#include <time.h>
+#endif
+
+/**
+ * @brief 'b' 类型对应的只读字节串
+ * @note 来自lua字符串时不复制, 指向lua内部的字符串内存, 只在该值被引用期间有效
+ */
+typedef struct clua_buffer
+{
+    const char* data; ///< 数据, 可包含'\0', 不保证以'\0'结尾
+    size_t len;       ///< 字节数
+} clua_buffer;
+
+/**
+ * @brief 'B' 类型对应的可变字节缓冲区, 即lua中由 clua.bytes 创建的userdata
+ *
+ * C函数可以直接读写 data 中的内容, lua中可以按下标读写字节, 用 sub 得到共享内存的切片,
+ * 只有调用 tostring 时才复制为lua字符串
+ */
+typedef struct clua_bytes
+{
+    char* data; ///< 数据, 切片时指向原缓冲区内部
+    size_t len; ///< 字节数
+} clua_bytes;
+
+/**
+ * @brief clua_array 数据的对齐字节数, 便于C侧使用SIMD
+ */
+#define CLUA_ARRAY_ALIGN 64
+
+/**
+ * @brief 连续存放的数值数组, 即lua中由 clua.array 创建的userdata
+ *
+ * 元素类型由 type 标识: 'x' float, 'X' double, 'i' int32_t, 'I' int64_t.
+ * lua中按下标读写元素时不会为每个元素创建lua对象
+ */
+typedef struct clua_array
+{
+    void* data; ///< 数据, 按 CLUA_ARRAY_ALIGN 对齐
+    size_t len; ///< 元素个数
+    char type;  ///< 元素类型
+} clua_array;
+
+/**
+ * @brief 'x' 'X' 'i' 'I' 类型对应的数组参数, 直接指向 clua_array 的数据, 不复制
+ */
+typedef struct clua_floats
+{
+    float* data;
+    size_t len;
+} clua_floats;
+
+typedef struct clua_doubles
+{
+    double* data;
+    size_t len;
+} clua_doubles;
+
+typedef struct clua_int32s
+{
+    int32_t* data;
+    size_t len;
+} clua_int32s;
+
+typedef struct clua_int64s
+{
+    int64_t* data;
+    size_t len;
+} clua_int64s;
 
 /**
  * @brief 获取lua堆栈中的值
@@ -22,7 +97,15 @@
  * - 'U' unsigned long long
  * - 'F' double
  * - 's' const char*
+ * - 'S' const char* 静态存储期的常量字符串, 作为返回值时按指针缓存lua字符串, 其它同 's'
  * - 'p' void*
+ * - 'P' void* 作为返回值时压入该指针唯一对应的userdata, 可附加字段, 其它同 'p'
+ * - 'b' clua_buffer 带长度的只读字节串, 可包含'\0', 也接受 clua_bytes
+ * - 'B' clua_bytes* 可变字节缓冲区, 作为返回值时压入其副本
+ * - 'x' clua_floats 数值数组, 同 'X' clua_doubles, 'i' clua_int32s, 'I' clua_int64s,
+ *       参数直接指向 clua_array 内存, 作为返回值时压入其副本
+ * - 'T' 由 @ref CLUA_STRUCT 定义的结构体, 对应lua表, 只能用于 CLUA_DEF, 此处不支持
+ * - 'O' 由 @ref CLUA_CLASS 定义的C对象指针, 对应带类型标签的userdata, 只能用于 CLUA_DEF, 此处不支持
  * @param value 输出值指针,指针类型则传入二级指针
  * @return 获取是否成功
  *  @retval 0 失败
@@ -42,7 +125,15 @@ int lua_get_value(lua_State* L, int index, char type, void* value);
  * - 'U' unsigned long long
  * - 'F' double
  * - 's' const char*
+ * - 'S' const char* 静态存储期的常量字符串, 作为返回值时按指针缓存lua字符串, 其它同 's'
  * - 'p' void*
+ * - 'P' void* 作为返回值时压入该指针唯一对应的userdata, 可附加字段, 其它同 'p'
+ * - 'b' clua_buffer 带长度的只读字节串, 可包含'\0', 也接受 clua_bytes
+ * - 'B' clua_bytes* 可变字节缓冲区, 作为返回值时压入其副本
+ * - 'x' clua_floats 数值数组, 同 'X' clua_doubles, 'i' clua_int32s, 'I' clua_int64s,
+ *       参数直接指向 clua_array 内存, 作为返回值时压入其副本
+ * - 'T' 由 @ref CLUA_STRUCT 定义的结构体, 对应lua表, 只能用于 CLUA_DEF, 此处不支持
+ * - 'O' 由 @ref CLUA_CLASS 定义的C对象指针, 对应带类型标签的userdata, 只能用于 CLUA_DEF, 此处不支持
  * @param value 值指针,指针类型则传入二级指针
  * @return 设置是否成功
  *  @retval 0 失败
@@ -50,6 +141,428 @@ int lua_get_value(lua_State* L, int index, char type, void* value);
  */
 int lua_set_value(lua_State* L, char type, void* value);
 
+/**
+ * @brief 取值类型不匹配时抛出lua错误
+ * @param L lua状态机
+ * @param index 堆栈位置
+ * @param type 期望的类型占位符
+ * @return 不会返回, 返回值仅用于在表达式中调用
+ */
+int lua_get_value_error(lua_State* L, int index, char type);
+
+/**
+ * @brief 正在转换的批量接口数组元素或结构体字段的位置, 转换失败时用于错误信息
+ *
+ * 这些值被压入栈顶后以 -1 转换, 错误信息中的位置取自这里而不是 -1
+ */
+typedef struct clua_element
+{
+    int index;         ///< 所在参数的堆栈位置, 为0时表示不在转换数组元素或结构体字段
+    int k;             ///< 数组元素序号, 结构体字段时为0
+    const char* field; ///< 结构体字段名, 数组元素时为NULL
+} clua_element;
+
+/**
+ * @brief 当前线程正在转换的数组元素或结构体字段, 转换失败时被读取并清零
+ */
+extern _Thread_local clua_element clua_element_current;
+
+/**
+ * @brief 参数类型错误的报告方式, 见 @ref lua_set_error_mode
+ */
+#define CLUA_ERROR_STRING 0 ///< 抛出附带调用栈的错误字符串, 默认方式
+#define CLUA_ERROR_OBJECT 1 ///< 抛出错误对象, 不格式化字符串也不生成调用栈
+
+/**
+ * @brief CLUA_ERROR_OBJECT 方式下抛出的错误对象, lua中为userdata, 可按字段名读取,
+ * tostring 时才格式化为错误信息
+ */
+typedef struct clua_error
+{
+    char name[32];           ///< 接口在调用处的名字, 未知时为 "?"
+    int index;               ///< 参数位置, 以方法方式调用时不计 self
+    int element;             ///< 批量接口中出错的数组元素序号, 不是数组元素时为0
+    const char* field;       ///< 出错的结构体字段名, 不是结构体字段时为NULL
+    const char* expected;    ///< 期望的C类型
+    const char* actual;      ///< 实际的lua类型, 对象参数为对象的类型名
+    char source[LUA_IDSIZE]; ///< 调用处的源文件
+    int line;                ///< 调用处的行号, 未知时为-1
+} clua_error;
+
+/**
+ * @brief 设置参数类型错误的报告方式
+ *
+ * CLUA_ERROR_OBJECT 方式下每次出错创建一个小的错误对象并抛出, 只复制字段, 不格式化字符串.
+ * 在 pcall 中探测参数类型时开销很小; 调用栈只在错误经过 @ref lua_error_handler 时生成.
+ * 每个错误对象相互独立, 可以在之后的调用出错后继续保留和读取
+ * @param L lua状态机
+ * @param mode CLUA_ERROR_STRING 或 CLUA_ERROR_OBJECT
+ */
+void lua_set_error_mode(lua_State* L, int mode);
+
+/**
+ * @brief 获取错误对象
+ * @param L lua状态机
+ * @param index 堆栈位置
+ * @return 不是错误对象时返回NULL
+ */
+const clua_error* lua_to_error(lua_State* L, int index);
+
+/**
+ * @brief 用作 lua_pcall 的错误处理函数, 将错误转换为字符串并附加调用栈,
+ * 也注册为 clua.traceback 供 xpcall 使用
+ * @param L lua状态机
+ * @return 1
+ */
+int lua_error_handler(lua_State* L);
+
+/**
+ * @brief 结构体字段描述
+ */
+typedef struct clua_struct_field
+{
+    const char* name; ///< 字段名, 即lua表中的键
+    size_t offset;    ///< 字段在结构体中的偏移
+    char type;        ///< 字段类型占位符
+} clua_struct_field;
+
+/**
+ * @brief 结构体描述, 由 @ref CLUA_STRUCT 生成, 名为 CLUA_STRUCT_DESC(S)
+ */
+typedef struct clua_struct
+{
+    const char* name;                ///< 结构体名
+    size_t size;                     ///< 结构体大小
+    int nfields;                     ///< 字段个数
+    const clua_struct_field* fields; ///< 字段描述
+} clua_struct;
+
+/**
+ * @brief 将结构体的字段名表压入lua堆栈, 表中第 i 项为第 i 个字段名
+ *
+ * 字段名表在第一次使用时创建并缓存在注册表中, 之后直接取出已经内部化的字段名字符串作为键,
+ * 不需要像 lua_getfield 那样每次重新计算字符串哈希
+ * @param L lua状态机
+ * @param desc 结构体描述
+ */
+void lua_push_struct_keys(lua_State* L, const clua_struct* desc);
+
+/**
+ * @brief 开始转换结构体, 记录所在参数的位置供字段转换失败时报告, 嵌套的结构体沿用外层参数的位置
+ * @param L lua状态机
+ * @param index 堆栈位置
+ * @return 之前的 clua_element_current, 转换结束后恢复
+ */
+clua_element lua_enter_struct(lua_State* L, int index);
+
+/**
+ * @brief 检查lua堆栈中的值是否为表, 并将结构体字段名表压入lua堆栈
+ * @param L lua状态机
+ * @param index 堆栈位置
+ * @param desc 结构体描述
+ * @return index 对应的绝对堆栈位置
+ */
+int lua_check_struct(lua_State* L, int index, const clua_struct* desc);
+
+/**
+ * @brief 按结构体描述将lua表转换为结构体, 用于手写接口
+ * @param L lua状态机
+ * @param index 堆栈位置
+ * @param desc 结构体描述, 字段类型含义见 @ref lua_get_value
+ * @param value 输出结构体指针
+ * @return 获取是否成功
+ */
+int lua_get_struct(lua_State* L, int index, const clua_struct* desc, void* value);
+
+/**
+ * @brief 按结构体描述将结构体转换为lua表并压入lua堆栈, 用于手写接口
+ * @param L lua状态机
+ * @param desc 结构体描述, 字段类型含义见 @ref lua_set_value
+ * @param value 结构体指针
+ * @return 设置是否成功
+ */
+int lua_set_struct(lua_State* L, const clua_struct* desc, const void* value);
+
+/**
+ * @brief C对象类型描述, 由 @ref CLUA_CLASS 生成, 名为 CLUA_CLASS_DESC(T)
+ */
+typedef struct clua_class
+{
+    const char* name;       ///< 类型名
+    void (*gc)(void* ptr);  ///< 释放函数
+} clua_class;
+
+/**
+ * @brief C对象在lua中的userdata
+ */
+typedef struct clua_object
+{
+    const clua_class* cls; ///< 类型标签
+    void* ptr;             ///< C对象指针, 释放后为NULL
+} clua_object;
+
+/**
+ * @brief 注册C对象类型, 创建元表并缓存在注册表中, 将方法表压入lua堆栈
+ *
+ * 元表的 __index 为方法表, __gc 调用类型的释放函数. 每个方法注册为以元表为上值的闭包,
+ * 方法取 self 时只需比较对象的元表和上值, 不需要像 luaL_checkudata 那样按名字查找注册表
+ * @param L lua状态机
+ * @param cls 类型描述
+ * @param methods 方法列表, 一般由 CLUA_METHOD 组成, 以 {NULL, NULL} 结尾
+ */
+void lua_register_class(lua_State* L, const clua_class* cls, const luaL_Reg* methods);
+
+/**
+ * @brief 创建C对象的userdata并压入lua堆栈, 对象被回收时调用类型的释放函数
+ * @param L lua状态机
+ * @param cls 类型描述, 必须已通过 @ref lua_register_class 注册
+ * @param ptr C对象指针, 为NULL时压入nil
+ * @return 新创建的userdata, ptr 为NULL时返回NULL
+ */
+clua_object* lua_new_object(lua_State* L, const clua_class* cls, void* ptr);
+
+/**
+ * @brief 获取lua堆栈中的C对象指针
+ * @param L lua状态机
+ * @param index 堆栈位置
+ * @param cls 类型描述
+ * @return 不是该类型的对象或对象已释放时返回NULL
+ */
+void* lua_to_object(lua_State* L, int index, const clua_class* cls);
+
+/**
+ * @brief 取C对象失败时抛出lua错误
+ * @param L lua状态机
+ * @param index 堆栈位置
+ * @param cls 期望的类型描述
+ * @return 不会返回, 返回值仅用于在表达式中调用
+ */
+int lua_object_error(lua_State* L, int index, const clua_class* cls);
+
+/**
+ * @brief 注册lua接口时的函数列表项, 兼容 luaL_Reg 的初始化写法
+ *
+ * target 不为NULL时注册为以 target 为上值的闭包, 用于 CLUA_SIG 生成的共享跳板
+ */
+typedef struct clua_reg
+{
+    const char* name;     ///< lua接口名
+    lua_CFunction func;   ///< lua接口函数或共享跳板
+    void* target;         ///< 跳板调用的C函数, 普通接口为NULL
+} clua_reg;
+
+/**
+ * @brief 将函数列表注册到堆栈顶部的表中, 用法同 luaL_register(L, NULL, l)
+ * @param L lua状态机
+ * @param regs 函数列表, 由 CLUA_REG 和 CLUA_REG_SIG 组成, 以 {NULL, NULL, NULL} 结尾
+ */
+void lua_register_funcs(lua_State* L, const clua_reg* regs);
+
+/**
+ * @brief 缓存行大小, 用于避免不同记录之间的伪共享
+ */
+#define CLUA_CACHE_LINE 64
+
+#ifdef CLUA_STATS
+/**
+ * @brief 单个lua接口的调用统计, 定义 CLUA_STATS 时由 CLUA_DEF 为每个接口生成
+ *
+ * 各计数器使用无锁的原子操作更新, 每条记录独占缓存行
+ */
+typedef struct clua_stat
+{
+    _Alignas(CLUA_CACHE_LINE) const char* name; ///< CLUA_STAT_PREFIX 加lua接口名
+    struct clua_stat* next;                      ///< 链表中的下一条记录
+    atomic_ullong calls;                         ///< 调用次数
+    atomic_ullong completed;                     ///< 成功返回次数
+    atomic_ullong failures;                      ///< 参数转换失败次数, 不含被调函数内的错误
+    atomic_ullong total_ns;                      ///< 成功调用的累计耗时
+    atomic_ullong max_ns;                        ///< 成功调用的最大耗时
+} clua_stat;
+
+/**
+ * @brief 正在转换参数的接口的统计记录, 参数转换失败时计入其 failures, 转换完成后置为NULL
+ */
+extern _Thread_local clua_stat* clua_stat_current;
+
+/**
+ * @brief 登记一条统计记录, 由 CLUA_DEF 生成的构造函数调用
+ * @param stat 统计记录
+ */
+void clua_stat_register(clua_stat* stat);
+
+/**
+ * @brief 统计记录名的前缀, 用于区分不同源文件中的同名接口
+ * @note 默认为定义接口的源文件名, 可在包含本头文件前定义为模块名, 如 "net."
+ */
+#ifndef CLUA_STAT_PREFIX
+#define CLUA_STAT_PREFIX __FILE__ ":"
+#endif
+#else
+typedef struct clua_stat clua_stat;
+#endif
+
+#ifdef CLUA_FFI
+/**
+ * @brief 单个lua接口的C函数签名, 定义 CLUA_FFI 时由 CLUA_DEF 为每个接口生成, 供 @ref lua_ffi_bind 使用
+ */
+typedef struct clua_ffi_decl
+{
+    const char* name;            ///< lua接口名
+    const char* fmt;             ///< 返回值+参数类型列表
+    const char* ret;             ///< 返回值C类型, 无返回值时为 "VOID"
+    const char* args;            ///< 参数C类型, 以逗号分隔
+    void* func;                  ///< C函数地址
+    lua_CFunction wrapper;       ///< CLUA_DEF 生成的lua接口函数
+    struct clua_ffi_decl* next;  ///< 链表中的下一条记录
+} clua_ffi_decl;
+
+/**
+ * @brief 登记一条函数签名, 由 CLUA_DEF 生成的构造函数调用
+ * @param decl 函数签名
+ */
+void clua_ffi_register(clua_ffi_decl* decl);
+#endif
+
+/**
+ * @brief 获取所有统计记录
+ * @return 链表头, 通过 next 遍历; 未定义 CLUA_STATS 时返回NULL
+ */
+clua_stat* clua_stat_list(void);
+
+/**
+ * @brief 将所有统计记录清零
+ */
+void clua_stat_reset(void);
+
+/**
+ * @brief 创建一个 clua_bytes 并压入lua堆栈, 内容初始化为0
+ * @param L lua状态机
+ * @param len 字节数
+ * @return 新创建的缓冲区
+ * @note 大小溢出时抛出lua错误
+ */
+clua_bytes* lua_new_bytes(lua_State* L, size_t len);
+
+/**
+ * @brief 获取lua堆栈中的 clua_bytes
+ * @param L lua状态机
+ * @param index 堆栈位置
+ * @return 不是 clua_bytes 时返回NULL
+ */
+clua_bytes* lua_to_bytes(lua_State* L, int index);
+
+/**
+ * @brief 压入指针对应的唯一userdata, 即 'P' 类型的返回值
+ *
+ * 每个状态机在注册表中用弱值表缓存 指针->userdata, 同一指针在其userdata被回收之前总是得到
+ * 同一个userdata, 重复返回时只需一次查表而不必分配. lua中可以用它作为表的键, 或通过 h.key = v
+ * 在它上面附加字段. 'p' 'P' 类型的参数都接受这种userdata
+ * @param L lua状态机
+ * @param value 指针, 为NULL时压入nil
+ * @return 1
+ */
+int lua_set_value_P(lua_State* L, const void* value);
+
+/**
+ * @brief 判断是否为 'P' userdata, 按元表判断, 已被 @ref lua_release_handle 释放的也返回1
+ * @param L lua状态机
+ * @param index 堆栈位置
+ */
+int lua_is_handle(lua_State* L, int index);
+
+/**
+ * @brief 获取 'P' userdata 对应的指针
+ * @param L lua状态机
+ * @param index 堆栈位置
+ * @return 不是 'P' userdata 或已被 @ref lua_release_handle 释放时返回NULL
+ */
+void* lua_to_handle(lua_State* L, int index);
+
+/**
+ * @brief C对象释放后调用, 从缓存中删除指针, 已有的userdata之后取得的指针为NULL,
+ * 作为 'p' 'P' 参数传入时报错, 避免新对象复用同一地址时取得旧的userdata
+ * @param L lua状态机
+ * @param ptr 指针
+ */
+void lua_release_handle(lua_State* L, const void* ptr);
+
+/**
+ * @brief 压入常量字符串, 即 'S' 类型的返回值
+ *
+ * 每个状态机在注册表中按指针缓存lua字符串, 同一个C字符串只在第一次返回时计算哈希并创建.
+ * 字符串必须在状态机的生命周期内不变, 一般为字面量或静态数组, 如状态名, 枚举名
+ * @param L lua状态机
+ * @param value 字符串, 为NULL时压入nil
+ * @return 1
+ */
+int lua_set_value_S(lua_State* L, const char* value);
+
+/**
+ * @brief 创建一个 clua_array 并压入lua堆栈, 内容初始化为0
+ * @param L lua状态机
+ * @param type 元素类型, 'x' 'X' 'i' 'I' 之一
+ * @param len 元素个数
+ * @return 新创建的数组
+ * @note type 无效或大小溢出时抛出lua错误
+ */
+clua_array* lua_new_array(lua_State* L, char type, size_t len);
+
+/**
+ * @brief 获取lua堆栈中的 clua_array
+ * @param L lua状态机
+ * @param index 堆栈位置
+ * @param type 元素类型, 为0时不检查
+ * @return 不是 clua_array 或元素类型不符时返回NULL
+ */
+clua_array* lua_to_array(lua_State* L, int index, char type);
+
+/**
+ * @brief 将表中由 CLUA_DEF 生成的lua接口替换为 LuaJIT FFI 函数指针
+ *
+ * 对表中每个仍为原接口函数的字段, 用 ffi.cast 将C函数地址转换为按 CLUA_DEF 签名声明的函数指针,
+ * 调用时不经过lua堆栈, 可以被 LuaJIT 编译进 trace. 只处理类型列表全部为 'v' 'd' 'u' 'f' 'D'
+ * 'U' 'F' 且 's' 只出现在参数中的接口, 其余接口以及 ffi.cast 失败的接口保留原接口函数.
+ *
+ * 与原接口的区别: 'D' 'U' 返回值为64位整数cdata, 不再转换为double; 参数不接受布尔值;
+ * 's' 参数为nil时传入NULL; 调用不计入 CLUA_STATS 统计
+ * @param L lua状态机
+ * @param index 接口表在堆栈中的位置, 一般为 luaL_register 返回的表
+ * @return 替换的接口数; 未定义 CLUA_FFI 或无法加载 ffi 库(如PUC Lua)时返回0
+ */
+int lua_ffi_bind(lua_State* L, int index);
+
+/**
+ * @brief 注册 clua 库, 结果表压入lua堆栈
+ *
+ * 提供以下lua接口:
+ * - clua.bytes(n) 创建n字节的 clua_bytes, 内容为0
+ * - clua.bytes(str) 创建 clua_bytes, 内容为str的副本
+ * - clua.array(type, n) 创建n个元素的 clua_array, type 为 "float" "double" "int32" "int64"
+ * - clua.array(type, t) 创建 clua_array, 内容为数组t的副本
+ * - clua.stats() 返回各接口的调用统计 { name = { calls, failures, total_ns, max_ns } },
+ *   name 为 CLUA_STAT_PREFIX 加接口名, failures 只含参数转换失败; 仅在定义 CLUA_STATS 时有数据
+ * - clua.stats_reset() 将调用统计清零
+ *
+ * clua_bytes 在lua中支持 #b, b[i], b[i] = byte, b:sub(i, j), b:tostring(i, j), tostring(b),
+ * 其中 sub 返回共享内存的切片, i 和 j 的含义同 string.sub.
+ * clua_array 在lua中支持 #a, a[i], a[i] = v, a:totable()
+ * @param L lua状态机
+ * @return 1
+ */
+int luaopen_clua(lua_State* L);
+
+/**
+ * @brief 批量接口调用前检查参数
+ * @param L lua状态机
+ * @param nargs 参数个数
+ * @param batchable 哪些参数可以为数组的位掩码, 第 i 位对应第 i+1 个参数, 其余参数为表时也作为单个值
+ * @param count 输出数组长度
+ * @return 参数中哪些为数组的位掩码, 第 i 位对应第 i+1 个参数
+ * @note 没有数组参数或数组长度不一致时抛出lua错误
+ */
+int lua_batch_prepare(lua_State* L, int nargs, int batchable, int* count);
+
 /**
  * @brief lua接口函数名
  * @param f C函数名
@@ -63,10 +576,10 @@ int lua_set_value(lua_State* L, char type, void* value);
 #define CLUA_DECL(f) int CLUA_FNAME(f)(lua_State * L)
 
 /**
- * @brief lua接口函数注册时的luaL_Reg结构
+ * @brief lua接口函数注册时的luaL_Reg结构, 也可用于 clua_reg 列表
  * @param f C函数名
  */
-#define CLUA_REG(f)  { #f, CLUA_FNAME(f) }
+#define CLUA_REG(f)  { .name = #f, .func = CLUA_FNAME(f) }
 
 /**
  * @brief CLUA_DEF时,用于标识返回值为空
@@ -92,9 +605,255 @@ int lua_set_value(lua_State* L, char type, void* value);
  * CLUA_DEF(myprint2, "vsd", VOID, const char*, int);
  *            ^         ^     ^      ^          ^
  *          函数名   类型列表 返回值   参数1      参数2
+ *
+ * @note fmt 必须为字符串字面量. 取值/压栈函数在编译期根据C类型选定,
+ *       生成的接口函数中没有运行时的类型分派; fmt 与C类型不一致时编译失败
+ * @note 最多16个参数, 参数可以用 @ref CLUA_OUT 标记为输出参数
  */
 #define CLUA_DEF(f, fmt, argret, ...)                                                              \
-    IMPL_CLUA_CAT(IMPL_CLUA_DEF_, IMPL_CLUA_CHECK(argret))(f, fmt, argret, ##__VA_ARGS__)
+    IMPL_CLUA_CAT(IMPL_CLUA_DEF_, IMPL_CLUA_CHECK(argret))(f, fmt, argret, ##__VA_ARGS__)          \
+    IMPL_CLUA_FFI_DEF(f, fmt, #argret, #__VA_ARGS__)
+
+/**
+ * @brief 在 CLUA_DEF 的参数类型列表中标记输出参数, C函数的对应参数为 type*
+ *
+ * 输出参数不占用lua参数. 接口在C栈上分配一个初始化为0的 type 变量并传入其地址,
+ * 调用后跟在返回值后面按顺序压入, lua中得到多个返回值. fmt 中对应项为 type 的类型占位符,
+ * 'S' 'P' 同样可用. 可用于 CLUA_DEF, CLUA_SIG 和 CLUA_DEF_ASYNC, 不能用于批量接口
+ *
+ * @note 示例
+ * int divmod(int a, int b, int* rem);
+ * CLUA_DEF(divmod, "dddd", int, int, int, CLUA_OUT(int));
+ * -- lua: local q, r = divmod(7, 2) => 3, 1
+ */
+#define CLUA_OUT(type) (type)
+
+/**
+ * @brief CLUA_STRUCT 生成的结构体描述名
+ * @param S 结构体类型名
+ */
+#define CLUA_STRUCT_DESC(S) clua_struct_##S
+
+/**
+ * @brief 定义结构体与lua表之间的转换, 字段按顺序列出, 最多16个
+ *
+ * 生成结构体描述 CLUA_STRUCT_DESC(S) 以及展开的逐字段转换函数, 字段类型由C类型自动推导.
+ * 要在 CLUA_DEF 中以 'T' 使用该结构体, 还需要把它加入 @ref CLUA_STRUCTS
+ *
+ * @note 示例
+ * typedef struct point { int x; int y; } point;
+ * CLUA_STRUCT(point, x, y)
+ *
+ * #undef CLUA_STRUCTS
+ * #define CLUA_STRUCTS(X) X(point)
+ *
+ * point move(point p, int dx);
+ * CLUA_DEF(move, "TTd", point, point, int);
+ * -- lua: move({x = 1, y = 2}, 3) => {x = 4, y = 2}
+ */
+#define CLUA_STRUCT(S, ...)                                                                        \
+    static const clua_struct_field impl_clua_fields_##S[] = {                                      \
+        IMPL_CLUA_FOREACH(IMPL_CLUA_STRUCT_FIELD, S, __VA_ARGS__)                                  \
+    };                                                                                             \
+    static const clua_struct CLUA_STRUCT_DESC(S) = { #S, sizeof(S), PP_NARG(__VA_ARGS__),          \
+                                                     impl_clua_fields_##S };                       \
+                                                                                                   \
+    static inline S lua_get_value_struct_##S(lua_State* L, int index)                              \
+    {                                                                                              \
+        S value;                                                                                   \
+        memset(&value, 0, sizeof(value));                                                          \
+        clua_element saved = lua_enter_struct(L, index);                                           \
+        index = lua_check_struct(L, index, &CLUA_STRUCT_DESC(S));                                  \
+        IMPL_CLUA_FOREACH(IMPL_CLUA_STRUCT_GET, S, __VA_ARGS__)                                    \
+        lua_pop(L, 1);                                                                             \
+        clua_element_current = saved;                                                              \
+        return value;                                                                              \
+    }                                                                                              \
+                                                                                                   \
+    static inline int lua_set_value_struct_##S(lua_State* L, S value)                              \
+    {                                                                                              \
+        lua_createtable(L, 0, PP_NARG(__VA_ARGS__));                                               \
+        lua_push_struct_keys(L, &CLUA_STRUCT_DESC(S));                                             \
+        IMPL_CLUA_FOREACH(IMPL_CLUA_STRUCT_SET, S, __VA_ARGS__)                                    \
+        lua_pop(L, 1);                                                                             \
+        return 1;                                                                                  \
+    }
+
+/**
+ * @brief 可在 CLUA_DEF 中使用的结构体列表, 每个结构体写作 X(S)
+ * @note 在 CLUA_DEF 展开时求值, 所以可以在包含本头文件之后 #undef 再重新定义
+ */
+#ifndef CLUA_STRUCTS
+#define CLUA_STRUCTS(X)
+#endif
+
+/**
+ * @brief CLUA_CLASS 生成的类型描述名
+ * @param T C对象类型名
+ */
+#define CLUA_CLASS_DESC(T) clua_class_##T
+
+/**
+ * @brief 定义C对象类型, 对象在lua中为带类型标签的userdata, 方法通过元表调用
+ *
+ * 要在 CLUA_DEF 中以 'O' 使用 T*, 还需要把它加入 @ref CLUA_CLASSES. 'O' 作为参数时检查对象类型,
+ * 作为返回值时创建新的userdata, 由lua负责调用 gc 释放; 返回不归lua所有的指针时应使用 'p'.
+ * 方法即第一个参数为 T* 的 CLUA_DEF 接口, 用 CLUA_METHOD 放入 @ref lua_register_class 的方法列表
+ * @param T C对象类型名
+ * @param gc 释放函数 void gc(T*), 不需要时为NULL
+ *
+ * @note 示例
+ * counter* counter_new(int start);
+ * void counter_free(counter* c);
+ * int counter_add(counter* c, int n);
+ * CLUA_CLASS(counter, counter_free)
+ *
+ * #undef CLUA_CLASSES
+ * #define CLUA_CLASSES(X) X(counter)
+ *
+ * CLUA_DEF(counter_new, "Od", counter*, int)
+ * CLUA_DEF(counter_add, "dOd", int, counter*, int)
+ *
+ * static const luaL_Reg counter_methods[] = { CLUA_METHOD(add, counter_add), { NULL, NULL } };
+ * lua_register_class(L, &CLUA_CLASS_DESC(counter), counter_methods);
+ * -- lua: local c = counter_new(1); c:add(2) => 3
+ *
+ * @note 类型描述只能有一份, 对象按描述的地址检查类型: CLUA_CLASS 只能在一个源文件中使用,
+ * 其它源文件用 @ref CLUA_CLASS_DECL 声明同一类型, 一般放在公共头文件中
+ */
+#define CLUA_CLASS(T, gc)                                                                          \
+    CLUA_CLASS_DECL(T)                                                                             \
+    static void impl_clua_gc_##T(void* ptr)                                                        \
+    {                                                                                              \
+        void (*fn)(T*) = gc;                                                                       \
+        if(fn != NULL)                                                                             \
+            fn((T*)ptr);                                                                           \
+    }                                                                                              \
+    const clua_class CLUA_CLASS_DESC(T) = { #T, impl_clua_gc_##T };
+
+/**
+ * @brief 声明由其它源文件的 CLUA_CLASS 定义的C对象类型, 之后可以同样在 CLUA_DEF 中以 'O' 使用
+ * @param T C对象类型名
+ */
+#define CLUA_CLASS_DECL(T)                                                                         \
+    extern const clua_class CLUA_CLASS_DESC(T);                                                    \
+                                                                                                   \
+    static inline T* lua_get_value_object_##T(lua_State* L, int index)                             \
+    {                                                                                              \
+        T* ptr = (T*)lua_to_object(L, index, &CLUA_CLASS_DESC(T));                                 \
+        if(ptr == NULL)                                                                            \
+            lua_object_error(L, index, &CLUA_CLASS_DESC(T));                                       \
+        return ptr;                                                                                \
+    }                                                                                              \
+                                                                                                   \
+    static inline int lua_set_value_object_##T(lua_State* L, T* value)                             \
+    {                                                                                              \
+        lua_new_object(L, &CLUA_CLASS_DESC(T), value);                                             \
+        return 1;                                                                                  \
+    }
+
+/**
+ * @brief 可在 CLUA_DEF 中使用的C对象类型列表, 每个类型写作 X(T)
+ * @note 同 @ref CLUA_STRUCTS, 可以在包含本头文件之后 #undef 再重新定义
+ */
+#ifndef CLUA_CLASSES
+#define CLUA_CLASSES(X)
+#endif
+
+/**
+ * @brief C对象方法注册时的luaL_Reg结构
+ * @param name lua中的方法名
+ * @param f C函数名, 必须已由 CLUA_DEF 定义且第一个参数为对象指针
+ */
+#define CLUA_METHOD(name, f) { #name, CLUA_FNAME(f) }
+
+/**
+ * @brief lua批量接口函数名
+ * @param f C函数名
+ */
+#define CLUA_BATCH_FNAME(f) _clua_batch_##f
+
+/**
+ * @brief lua批量接口函数声明
+ * @param f C函数名
+ */
+#define CLUA_BATCH_DECL(f) int CLUA_BATCH_FNAME(f)(lua_State * L)
+
+/**
+ * @brief lua批量接口函数注册时的luaL_Reg结构, 在lua中的名字为 f_batch
+ * @param f C函数名
+ */
+#define CLUA_REG_BATCH(f) { .name = #f "_batch", .func = CLUA_BATCH_FNAME(f) }
+
+/**
+ * @brief 定义lua接口及其批量版本, 参数同 @ref CLUA_DEF, 至少需要1个参数, 不支持输出参数
+ *
+ * 批量接口的每个参数为lua数组或单个值(对所有元素广播), 所有数组长度必须相同.
+ * 'T' 结构体参数本身就是lua表, 总是作为单个值整体传入.
+ * 一次调用在C循环中对每个元素调用 f, 返回值按顺序放入预先分配好大小的表中返回;
+ * 无返回值时不返回任何值
+ *
+ * @note 示例
+ * int add(int a, int b);
+ * CLUA_DEF_BATCH(add, "ddd", int, int, int);
+ * -- lua: add_batch({1, 2, 3}, {4, 5, 6}) => {5, 7, 9}
+ * --      add_batch({1, 2, 3}, 10)        => {11, 12, 13}
+ */
+#define CLUA_DEF_BATCH(f, fmt, argret, ...)                                                        \
+    IMPL_CLUA_CAT(IMPL_CLUA_DEF_, IMPL_CLUA_CHECK(argret))(f, fmt, argret, ##__VA_ARGS__)          \
+    IMPL_CLUA_FFI_DEF(f, fmt, #argret, #__VA_ARGS__)                                               \
+    IMPL_CLUA_CAT(IMPL_CLUA_DEF_BATCH_, IMPL_CLUA_CHECK(argret))(f, fmt, argret, ##__VA_ARGS__)
+
+/**
+ * @brief 共享跳板函数名
+ * @param sig 签名名
+ */
+#define CLUA_SIG_FNAME(sig) _clua_sig_##sig
+
+/**
+ * @brief 签名对应的C函数指针类型
+ * @param sig 签名名
+ */
+#define CLUA_SIG_TYPE(sig) _clua_sig_##sig##_t
+
+/**
+ * @brief 定义一个签名的共享跳板, 参数同 @ref CLUA_DEF, 只是第一个参数为签名名而不是C函数名
+ *
+ * CLUA_DEF 为每个C函数生成一份完整的接口函数. 大量接口签名相同时, 可以对每种签名只生成一个跳板,
+ * 跳板从闭包上值中取出C函数指针后调用, 参数转换代码只有一份, 减小代码体积和指令缓存占用.
+ * 代价是每次调用多一次取上值和间接调用; 定义 CLUA_STATS 时按签名而不是按函数统计.
+ * 跳板的上值不是类型元表, 'O' 类型参数总是到注册表中查找元表比较
+ *
+ * @note 示例
+ * int add(int a, int b);
+ * int sub(int a, int b);
+ * CLUA_SIG(ddd, "ddd", int, int, int)
+ * CLUA_DEF_SIG(add, ddd)
+ * CLUA_DEF_SIG(sub, ddd)
+ * static const clua_reg lib[] = {
+ *     CLUA_REG_SIG(add, ddd), CLUA_REG_SIG(sub, ddd), {NULL, NULL, NULL}
+ * };
+ * lua_register_funcs(L, lib);
+ */
+#define CLUA_SIG(sig, fmt, argret, ...)                                                            \
+    IMPL_CLUA_CAT(IMPL_CLUA_SIG_, IMPL_CLUA_CHECK(argret))(sig, fmt, argret, ##__VA_ARGS__)
+
+/**
+ * @brief 声明C函数使用某个签名的跳板, 编译期检查函数类型与签名一致
+ * @param f C函数名
+ * @param sig 已由 CLUA_SIG 定义的签名名
+ */
+#define CLUA_DEF_SIG(f, sig)                                                                       \
+    _Static_assert(_Generic(&(f), CLUA_SIG_TYPE(sig): 1, default: 0),                              \
+                   "CLUA_DEF_SIG: " #f " does not match " #sig);                                   \
+    IMPL_CLUA_FFI_DEF_SIG(f, sig)
+
+/**
+ * @brief 使用共享跳板的lua接口注册时的 clua_reg 结构, 注册为以C函数指针为上值的闭包
+ * @param f C函数名
+ * @param sig 签名名
+ */
+#define CLUA_REG_SIG(f, sig) { #f, CLUA_SIG_FNAME(sig), (void*)(f) }
 
 
 /*******************
@@ -106,11 +865,6 @@ int lua_set_value(lua_State* L, char type, void* value);
 #define IMPL_CLUA_CHECK(...) IMPL_CLUA_GET_SEC(__VA_ARGS__, 0)
 #define IMPL_CLUA_PROBE(x) x, 1
 
-#define IMPL_CLUA_DEF_0(f, fmt, argret, ...)                                                       \
-    IMPL_CLUA_CAT(IMPL_CLUA_DEF_RET_, PP_NARG(__VA_ARGS__))(f, fmt, argret, ##__VA_ARGS__)
-#define IMPL_CLUA_DEF_1(f, fmt, _1, _2, ...)                                                       \
-    IMPL_CLUA_CAT(IMPL_CLUA_DEF_VOID_, PP_NARG(__VA_ARGS__))(f, fmt, ##__VA_ARGS__)
-
 #define PP_ARG_N(_1, _2, _3, _4, _5, _6, _7, _8, _9, _10, _11, _12, _13, _14, _15, _16, _17, _18,  \
                  _19, _20, _21, _22, _23, _24, _25, _26, _27, _28, _29, _30, _31, _32, _33, _34,   \
                  _35, _36, _37, _38, _39, _40, _41, _42, _43, _44, _45, _46, _47, _48, _49, _50,   \
@@ -125,171 +879,656 @@ int lua_set_value(lua_State* L, char type, void* value);
 
 #define PP_NARG(...) PP_NARG_(_, ##__VA_ARGS__, PP_RSEQ_N())
 
-#define IMPL_CLUA_DEF_VOID_0(f, fmt)                                                               \
-    CLUA_DECL(f)                                                                                   \
-    {                                                                                              \
-        (void)(L);                                                                                 \
-        (void)(fmt);                                                                               \
-        f();                                                                                       \
-        return 0;                                                                                  \
+/**
+ * @brief 根据C类型得到对应的类型占位符, 未列出的类型均视为指针 'p'
+ */
+#define IMPL_CLUA_TYPE_CHAR(type)                                                                  \
+    _Generic((type){0},                                                                            \
+        int: 'd',                                                                                  \
+        unsigned: 'u',                                                                             \
+        float: 'f',                                                                                \
+        long: 'D',                                                                                 \
+        long long: 'D',                                                                            \
+        unsigned long: 'U',                                                                        \
+        unsigned long long: 'U',                                                                   \
+        double: 'F',                                                                               \
+        char*: 's',                                                                                \
+        const char*: 's',                                                                          \
+        clua_buffer: 'b',                                                                          \
+        clua_bytes*: 'B',                                                                          \
+        clua_floats: 'x',                                                                          \
+        clua_doubles: 'X',                                                                         \
+        clua_int32s: 'i',                                                                          \
+        clua_int64s: 'I',                                                                          \
+        CLUA_STRUCTS(IMPL_CLUA_STRUCT_CHAR)                                                        \
+        CLUA_CLASSES(IMPL_CLUA_CLASS_CHAR)                                                         \
+        default: 'p')
+
+/**
+ * @brief 根据C类型在编译期选择取值函数, 读取堆栈 index 处的参数
+ */
+#define IMPL_CLUA_GET(type, index)                                                                 \
+    _Generic((type){0},                                                                            \
+        int: lua_get_value_d(L, index),                                                            \
+        unsigned: lua_get_value_u(L, index),                                                       \
+        float: lua_get_value_f(L, index),                                                          \
+        long: lua_get_value_D(L, index),                                                           \
+        long long: lua_get_value_D(L, index),                                                      \
+        unsigned long: lua_get_value_U(L, index),                                                  \
+        unsigned long long: lua_get_value_U(L, index),                                             \
+        double: lua_get_value_F(L, index),                                                         \
+        char*: (char*)lua_get_value_s(L, index),                                                   \
+        const char*: lua_get_value_s(L, index),                                                    \
+        clua_buffer: lua_get_value_b(L, index),                                                    \
+        clua_bytes*: lua_get_value_B(L, index),                                                    \
+        clua_floats: lua_get_value_x(L, index),                                                    \
+        clua_doubles: lua_get_value_X(L, index),                                                   \
+        clua_int32s: lua_get_value_i(L, index),                                                    \
+        clua_int64s: lua_get_value_I(L, index),                                                    \
+        default: _Generic((type){0},                                                               \
+            CLUA_STRUCTS(IMPL_CLUA_STRUCT_GETTER)                                                  \
+            CLUA_CLASSES(IMPL_CLUA_CLASS_GETTER)                                                   \
+            default: lua_get_value_p)(L, index))
+
+/**
+ * @brief 根据C类型在编译期选择压栈函数
+ */
+#define IMPL_CLUA_SET(type, value) IMPL_CLUA_SET_AS(0, type, value)
+
+/**
+ * @brief 根据C类型和类型占位符在编译期选择压栈函数, c 为 'S' 'P' 时使用带缓存的版本
+ * @param c 类型占位符, 必须为常量
+ */
+#define IMPL_CLUA_SET_AS(c, type, value)                                                           \
+    _Generic((type){0},                                                                            \
+        int: lua_set_value_d,                                                                      \
+        unsigned: lua_set_value_u,                                                                 \
+        float: lua_set_value_f,                                                                    \
+        long: lua_set_value_D,                                                                     \
+        long long: lua_set_value_D,                                                                \
+        unsigned long: lua_set_value_U,                                                            \
+        unsigned long long: lua_set_value_U,                                                       \
+        double: lua_set_value_F,                                                                   \
+        char*: (c) == 'S' ? lua_set_value_S : lua_set_value_s,                                     \
+        const char*: (c) == 'S' ? lua_set_value_S : lua_set_value_s,                               \
+        clua_buffer: lua_set_value_b,                                                              \
+        clua_bytes*: lua_set_value_B,                                                              \
+        clua_floats: lua_set_value_x,                                                              \
+        clua_doubles: lua_set_value_X,                                                             \
+        clua_int32s: lua_set_value_i,                                                              \
+        clua_int64s: lua_set_value_I,                                                              \
+        CLUA_STRUCTS(IMPL_CLUA_STRUCT_SETTER)                                                      \
+        CLUA_CLASSES(IMPL_CLUA_CLASS_SETTER)                                                       \
+        default: (c) == 'P' ? lua_set_value_P : lua_set_value_p)(L, value)
+
+/**
+ * @brief 去掉参数列表的第一项, 用于去掉 FOREACH 展开结果开头多余的逗号
+ */
+#define IMPL_CLUA_DROP(...) IMPL_CLUA_DROP_(__VA_ARGS__)
+#define IMPL_CLUA_DROP_(x, ...) __VA_ARGS__
+
+/**
+ * @brief 对每个参数 x 展开 m(ctx, i, x), i 从1开始, 0到16个参数
+ */
+#define IMPL_CLUA_FOREACH(m, ctx, ...)                                                             \
+    IMPL_CLUA_CAT(IMPL_CLUA_FOREACH_, PP_NARG(__VA_ARGS__))(m, ctx, __VA_ARGS__)
+#define IMPL_CLUA_FOREACH_0(m, c, ...)
+#define IMPL_CLUA_FOREACH_1(m, c, x1) m(c, 1, x1)
+#define IMPL_CLUA_FOREACH_2(m, c, x1, x2)                                                          \
+    IMPL_CLUA_FOREACH_1(m, c, x1) m(c, 2, x2)
+#define IMPL_CLUA_FOREACH_3(m, c, x1, x2, x3)                                                      \
+    IMPL_CLUA_FOREACH_2(m, c, x1, x2) m(c, 3, x3)
+#define IMPL_CLUA_FOREACH_4(m, c, x1, x2, x3, x4)                                                  \
+    IMPL_CLUA_FOREACH_3(m, c, x1, x2, x3) m(c, 4, x4)
+#define IMPL_CLUA_FOREACH_5(m, c, x1, x2, x3, x4, x5)                                              \
+    IMPL_CLUA_FOREACH_4(m, c, x1, x2, x3, x4) m(c, 5, x5)
+#define IMPL_CLUA_FOREACH_6(m, c, x1, x2, x3, x4, x5, x6)                                          \
+    IMPL_CLUA_FOREACH_5(m, c, x1, x2, x3, x4, x5) m(c, 6, x6)
+#define IMPL_CLUA_FOREACH_7(m, c, x1, x2, x3, x4, x5, x6, x7)                                      \
+    IMPL_CLUA_FOREACH_6(m, c, x1, x2, x3, x4, x5, x6) m(c, 7, x7)
+#define IMPL_CLUA_FOREACH_8(m, c, x1, x2, x3, x4, x5, x6, x7, x8)                                  \
+    IMPL_CLUA_FOREACH_7(m, c, x1, x2, x3, x4, x5, x6, x7) m(c, 8, x8)
+#define IMPL_CLUA_FOREACH_9(m, c, x1, x2, x3, x4, x5, x6, x7, x8, x9)                              \
+    IMPL_CLUA_FOREACH_8(m, c, x1, x2, x3, x4, x5, x6, x7, x8) m(c, 9, x9)
+#define IMPL_CLUA_FOREACH_10(m, c, x1, x2, x3, x4, x5, x6, x7, x8, x9, x10)                        \
+    IMPL_CLUA_FOREACH_9(m, c, x1, x2, x3, x4, x5, x6, x7, x8, x9) m(c, 10, x10)
+#define IMPL_CLUA_FOREACH_11(m, c, x1, x2, x3, x4, x5, x6, x7, x8, x9, x10, x11)                   \
+    IMPL_CLUA_FOREACH_10(m, c, x1, x2, x3, x4, x5, x6, x7, x8, x9, x10) m(c, 11, x11)
+#define IMPL_CLUA_FOREACH_12(m, c, x1, x2, x3, x4, x5, x6, x7, x8, x9, x10, x11, x12)              \
+    IMPL_CLUA_FOREACH_11(m, c, x1, x2, x3, x4, x5, x6, x7, x8, x9, x10, x11) m(c, 12, x12)
+#define IMPL_CLUA_FOREACH_13(m, c, x1, x2, x3, x4, x5, x6, x7, x8, x9, x10, x11, x12, x13)         \
+    IMPL_CLUA_FOREACH_12(m, c, x1, x2, x3, x4, x5, x6, x7, x8, x9, x10, x11, x12) m(c, 13, x13)
+#define IMPL_CLUA_FOREACH_14(m, c, x1, x2, x3, x4, x5, x6, x7, x8, x9, x10, x11, x12, x13, x14)    \
+    IMPL_CLUA_FOREACH_13(m, c, x1, x2, x3, x4, x5, x6, x7, x8, x9, x10, x11, x12,                  \
+                         x13) m(c, 14, x14)
+#define IMPL_CLUA_FOREACH_15(m, c, x1, x2, x3, x4, x5, x6, x7, x8, x9, x10, x11, x12, x13, x14,    \
+                             x15)                                                                  \
+    IMPL_CLUA_FOREACH_14(m, c, x1, x2, x3, x4, x5, x6, x7, x8, x9, x10, x11, x12, x13,             \
+                         x14) m(c, 15, x15)
+#define IMPL_CLUA_FOREACH_16(m, c, x1, x2, x3, x4, x5, x6, x7, x8, x9, x10, x11, x12, x13, x14,    \
+                             x15, x16)                                                             \
+    IMPL_CLUA_FOREACH_15(m, c, x1, x2, x3, x4, x5, x6, x7, x8, x9, x10, x11, x12, x13, x14,        \
+                         x15) m(c, 16, x16)
+
+#define IMPL_CLUA_STRUCT_CHAR(S) S: 'T',
+#define IMPL_CLUA_STRUCT_GETTER(S) S: lua_get_value_struct_##S,
+#define IMPL_CLUA_STRUCT_SETTER(S) S: lua_set_value_struct_##S,
+#define IMPL_CLUA_CLASS_CHAR(T) T*: 'O',
+#define IMPL_CLUA_CLASS_GETTER(T) T*: lua_get_value_object_##T,
+#define IMPL_CLUA_CLASS_SETTER(T) T*: lua_set_value_object_##T,
+
+#define IMPL_CLUA_STRUCT_FIELD(S, i, f)                                                            \
+    { #f, offsetof(S, f), IMPL_CLUA_TYPE_CHAR(__typeof__(((S*)0)->f)) },
+
+/**
+ * @brief 读取一个字段, 栈顶为字段名表, index 为lua表的绝对位置
+ */
+#define IMPL_CLUA_STRUCT_GET(S, i, f)                                                              \
+    lua_rawgeti(L, -1, i);                                                                         \
+    lua_rawget(L, index);                                                                          \
+    clua_element_current.field = #f;                                                               \
+    value.f = IMPL_CLUA_GET(__typeof__(value.f), -1);                                              \
+    lua_pop(L, 1);
+
+/**
+ * @brief 写入一个字段, 栈顶为字段名表, 其下为lua表
+ */
+#define IMPL_CLUA_STRUCT_SET(S, i, f)                                                              \
+    lua_rawgeti(L, -1, i);                                                                         \
+    IMPL_CLUA_SET(__typeof__(value.f), value.f);                                                   \
+    lua_rawset(L, -4);
+
+#ifdef CLUA_STATS
+static inline unsigned long long clua_stat_now(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (unsigned long long)ts.tv_sec * 1000000000ull + (unsigned long long)ts.tv_nsec;
+}
+
+static inline void clua_stat_done(clua_stat* stat, unsigned long long start)
+{
+    unsigned long long ns = clua_stat_now() - start;
+    unsigned long long max = atomic_load_explicit(&stat->max_ns, memory_order_relaxed);
+    atomic_fetch_add_explicit(&stat->completed, 1, memory_order_relaxed);
+    atomic_fetch_add_explicit(&stat->total_ns, ns, memory_order_relaxed);
+    while(ns > max && !atomic_compare_exchange_weak_explicit(&stat->max_ns, &max, ns,
+                                                             memory_order_relaxed,
+                                                             memory_order_relaxed))
+    {
     }
+}
 
-#define IMPL_CLUA_DEF_VOID_1(f, fmt, arg1)                                                         \
-    CLUA_DECL(f)                                                                                   \
+/**
+ * @brief 生成lua接口函数头, 统计版本将函数体包装在计时代码中
+ * @param name lua接口名字符串
+ * @param fn lua接口函数名
+ * @note 调用期间出错时 lua_error 直接跳出, 不会计入 completed; 只有参数转换失败计入 failures
+ */
+#define IMPL_CLUA_WRAPPER(name, fn)                                                                \
+    static int IMPL_CLUA_CAT(fn, _body)(lua_State * L);                                            \
+    static clua_stat IMPL_CLUA_CAT(fn, _stat) = { CLUA_STAT_PREFIX name, NULL, 0, 0, 0, 0, 0 };    \
+    __attribute__((constructor)) static void IMPL_CLUA_CAT(fn, _stat_init)(void)                   \
     {                                                                                              \
-        arg1 a1;                                                                                   \
-        if(lua_get_value(L, 1, fmt[1], &a1))                                                       \
-        {                                                                                          \
-            f(a1);                                                                                 \
-        }                                                                                          \
-        return 0;                                                                                  \
-    }
+        clua_stat_register(&IMPL_CLUA_CAT(fn, _stat));                                             \
+    }                                                                                              \
+    int fn(lua_State* L)                                                                           \
+    {                                                                                              \
+        atomic_fetch_add_explicit(&IMPL_CLUA_CAT(fn, _stat).calls, 1, memory_order_relaxed);       \
+        unsigned long long start = clua_stat_now();                                                \
+        clua_stat* prev = clua_stat_current;                                                       \
+        clua_stat_current = &IMPL_CLUA_CAT(fn, _stat);                                             \
+        int ret = IMPL_CLUA_CAT(fn, _body)(L);                                                     \
+        clua_stat_current = prev;                                                                  \
+        clua_stat_done(&IMPL_CLUA_CAT(fn, _stat), start);                                          \
+        return ret;                                                                                \
+    }                                                                                              \
+    static inline int IMPL_CLUA_CAT(fn, _body)(lua_State * L)
+
+/**
+ * @brief 参数已全部取出, 之后的错误不再计入 failures
+ */
+#define IMPL_CLUA_ARGS_DONE() clua_stat_current = NULL
+#else
+#define IMPL_CLUA_WRAPPER(name, fn) int fn(lua_State* L)
+#define IMPL_CLUA_ARGS_DONE() (void)0
+#endif
 
-#define IMPL_CLUA_DEF_VOID_2(f, fmt, arg1, arg2)                                                   \
-    CLUA_DECL(f)                                                                                   \
+#ifdef CLUA_FFI
+/**
+ * @brief 生成并登记接口的C函数签名
+ * @param ret 返回值C类型字符串
+ * @param args 参数C类型列表字符串
+ */
+#define IMPL_CLUA_FFI_DEF(f, fmt, ret, args)                                                       \
+    static clua_ffi_decl IMPL_CLUA_CAT(CLUA_FNAME(f), _ffi) = {                                    \
+        #f, fmt, ret, args, (void*)f, CLUA_FNAME(f), NULL                                          \
+    };                                                                                             \
+    __attribute__((constructor)) static void IMPL_CLUA_CAT(CLUA_FNAME(f), _ffi_init)(void)         \
     {                                                                                              \
-        arg1 a1;                                                                                   \
-        arg2 a2;                                                                                   \
-        if(lua_get_value(L, 1, fmt[1], &a1) && lua_get_value(L, 2, fmt[2], &a2))                   \
-        {                                                                                          \
-            f(a1, a2);                                                                             \
-        }                                                                                          \
-        return 0;                                                                                  \
+        clua_ffi_register(&IMPL_CLUA_CAT(CLUA_FNAME(f), _ffi));                                    \
     }
 
-#define IMPL_CLUA_DEF_VOID_3(f, fmt, arg1, arg2, arg3)                                             \
-    CLUA_DECL(f)                                                                                   \
+/**
+ * @brief 生成签名的字符串, 供 CLUA_DEF_SIG 登记函数签名
+ */
+#define IMPL_CLUA_FFI_SIG(sig, fmt, ret, args)                                                     \
+    __attribute__((unused)) static const char IMPL_CLUA_CAT(CLUA_SIG_FNAME(sig), _fmt)[] = fmt;    \
+    __attribute__((unused)) static const char IMPL_CLUA_CAT(CLUA_SIG_FNAME(sig), _ret)[] = ret;    \
+    __attribute__((unused)) static const char IMPL_CLUA_CAT(CLUA_SIG_FNAME(sig), _args)[] = args;
+
+#define IMPL_CLUA_FFI_DEF_SIG(f, sig)                                                              \
+    static clua_ffi_decl IMPL_CLUA_CAT(CLUA_FNAME(f), _ffi_sig) = {                                \
+        #f,                                                                                        \
+        IMPL_CLUA_CAT(CLUA_SIG_FNAME(sig), _fmt),                                                  \
+        IMPL_CLUA_CAT(CLUA_SIG_FNAME(sig), _ret),                                                  \
+        IMPL_CLUA_CAT(CLUA_SIG_FNAME(sig), _args),                                                 \
+        (void*)f,                                                                                  \
+        CLUA_SIG_FNAME(sig),                                                                       \
+        NULL                                                                                       \
+    };                                                                                             \
+    __attribute__((constructor)) static void IMPL_CLUA_CAT(CLUA_FNAME(f), _ffi_sig_init)(void)     \
     {                                                                                              \
-        arg1 a1;                                                                                   \
-        arg2 a2;                                                                                   \
-        arg3 a3;                                                                                   \
-        if(lua_get_value(L, 1, fmt[1], &a1) && lua_get_value(L, 2, fmt[2], &a2) &&                 \
-           lua_get_value(L, 3, fmt[3], &a3))                                                       \
-        {                                                                                          \
-            f(a1, a2, a3);                                                                         \
-        }                                                                                          \
-        return 0;                                                                                  \
+        clua_ffi_register(&IMPL_CLUA_CAT(CLUA_FNAME(f), _ffi_sig));                                \
     }
+#else
+#define IMPL_CLUA_FFI_DEF(f, fmt, ret, args)
+#define IMPL_CLUA_FFI_SIG(sig, fmt, ret, args)
+#define IMPL_CLUA_FFI_DEF_SIG(f, sig)
+#endif
 
-#define IMPL_CLUA_DEF_VOID_4(f, fmt, arg1, arg2, arg3, arg4)                                       \
-    CLUA_DECL(f)                                                                                   \
-    {                                                                                              \
-        arg1 a1;                                                                                   \
-        arg2 a2;                                                                                   \
-        arg3 a3;                                                                                   \
-        arg3 a4;                                                                                   \
-        if(lua_get_value(L, 1, fmt[1], &a1) && lua_get_value(L, 2, fmt[2], &a2) &&                 \
-           lua_get_value(L, 3, fmt[3], &a3) && lua_get_value(L, 4, fmt[4], &a4))                   \
-        {                                                                                          \
-            f(a1, a2, a3, a4);                                                                     \
-        }                                                                                          \
-        return 0;                                                                                  \
+/**
+ * @brief fmt 第 i 项是否与C类型一致
+ */
+#define IMPL_CLUA_FMT_IS(fmt, i, type) IMPL_CLUA_FMT_MATCH((fmt)[i], IMPL_CLUA_TYPE_CHAR(type))
+
+/**
+ * @brief 占位符 c 是否可用于类型占位符为 t 的C类型, 'S' 'P' 分别是 's' 'p' 的带缓存版本
+ */
+#define IMPL_CLUA_FMT_MATCH(c, t)                                                                  \
+    ((c) == (t) || ((c) == 'S' && (t) == 's') || ((c) == 'P' && (t) == 'p'))
+
+/**
+ * @brief 编译期检查 fmt 与C类型是否匹配
+ * @param fmt 类型列表字符串, 必须为字符串字面量
+ * @param n 返回值+参数个数
+ * @param cond 各项类型检查结果
+ * @note 长度不符时报 static assertion 错误;
+ *       类型不符时除数为0, 报 "initializer element is not constant" 错误
+ */
+#define IMPL_CLUA_FMT_ASSERT(fmt, n, cond)                                                         \
+    _Static_assert(sizeof(fmt) == (n) + 1, "CLUA_DEF: fmt length does not match the C types");     \
+    static const char impl_clua_fmt_ok = 1 / (cond);                                               \
+    (void)impl_clua_fmt_ok
+
+static inline int lua_get_value_d(lua_State* L, int index)
+{
+    if(lua_isnumber(L, index))
+        return (int)lua_tointeger(L, index);
+    if(lua_isboolean(L, index))
+        return lua_toboolean(L, index);
+    return lua_get_value_error(L, index, 'd');
+}
+
+static inline unsigned lua_get_value_u(lua_State* L, int index)
+{
+    if(lua_isnumber(L, index))
+        return (unsigned)lua_tointeger(L, index);
+    if(lua_isboolean(L, index))
+        return (unsigned)lua_toboolean(L, index);
+    return (unsigned)lua_get_value_error(L, index, 'u');
+}
+
+static inline float lua_get_value_f(lua_State* L, int index)
+{
+    if(lua_isnumber(L, index))
+        return (float)lua_tonumber(L, index);
+    return (float)lua_get_value_error(L, index, 'f');
+}
+
+static inline long long lua_get_value_D(lua_State* L, int index)
+{
+    if(lua_isnumber(L, index))
+        return lua_tointeger(L, index);
+    if(lua_isboolean(L, index))
+        return lua_toboolean(L, index);
+    return lua_get_value_error(L, index, 'D');
+}
+
+static inline unsigned long long lua_get_value_U(lua_State* L, int index)
+{
+    if(lua_isnumber(L, index))
+        return (unsigned long long)lua_tointeger(L, index);
+    if(lua_isboolean(L, index))
+        return (unsigned long long)lua_toboolean(L, index);
+    return (unsigned long long)lua_get_value_error(L, index, 'U');
+}
+
+static inline double lua_get_value_F(lua_State* L, int index)
+{
+    if(lua_isnumber(L, index))
+        return lua_tonumber(L, index);
+    return lua_get_value_error(L, index, 'F');
+}
+
+static inline const char* lua_get_value_s(lua_State* L, int index)
+{
+    if(lua_isstring(L, index))
+        return lua_tostring(L, index);
+    lua_get_value_error(L, index, 's');
+    return NULL;
+}
+
+static inline void* lua_get_value_p(lua_State* L, int index)
+{
+    if(lua_islightuserdata(L, index))
+        return lua_touserdata(L, index);
+    if(lua_isuserdata(L, index))
+    {
+        /* 已释放的 'P' userdata 报错, 不能退回为userdata本身的地址 */
+        if(!lua_is_handle(L, index))
+            return (void*)lua_topointer(L, index);
+        void* ptr = *(void**)lua_touserdata(L, index);
+        if(ptr != NULL)
+            return ptr;
     }
+    lua_get_value_error(L, index, 'p');
+    return NULL;
+}
 
-#define IMPL_CLUA_DEF_VOID_5(f, fmt, arg1, arg2, arg3, arg4, arg5)                                 \
-    CLUA_DECL(f)                                                                                   \
-    {                                                                                              \
-        arg1 a1;                                                                                   \
-        arg2 a2;                                                                                   \
-        arg3 a3;                                                                                   \
-        arg3 a4;                                                                                   \
-        arg3 a5;                                                                                   \
-        if(lua_get_value(L, 1, fmt[1], &a1) && lua_get_value(L, 2, fmt[2], &a2) &&                 \
-           lua_get_value(L, 3, fmt[3], &a3) && lua_get_value(L, 4, fmt[4], &a4) &&                 \
-           lua_get_value(L, 5, fmt[5], &a5))                                                       \
-        {                                                                                          \
-            f(a1, a2, a3, a4, a5);                                                                 \
-        }                                                                                          \
-        return 0;                                                                                  \
+static inline clua_buffer lua_get_value_b(lua_State* L, int index)
+{
+    clua_buffer value = { NULL, 0 };
+    clua_bytes* bytes;
+    if(lua_isstring(L, index))
+    {
+        value.data = lua_tolstring(L, index, &value.len);
+    }
+    else if((bytes = lua_to_bytes(L, index)) != NULL)
+    {
+        value.data = bytes->data;
+        value.len = bytes->len;
+    }
+    else
+    {
+        lua_get_value_error(L, index, 'b');
     }
+    return value;
+}
+
+static inline clua_bytes* lua_get_value_B(lua_State* L, int index)
+{
+    clua_bytes* value = lua_to_bytes(L, index);
+    if(value == NULL)
+        lua_get_value_error(L, index, 'B');
+    return value;
+}
+
+static inline int lua_set_value_d(lua_State* L, int value)
+{
+    lua_pushnumber(L, value);
+    return 1;
+}
+
+static inline int lua_set_value_u(lua_State* L, unsigned value)
+{
+    lua_pushnumber(L, value);
+    return 1;
+}
 
-#define IMPL_CLUA_DEF_RET_0(f, fmt, argret)                                                        \
-    CLUA_DECL(f)                                                                                   \
+static inline int lua_set_value_f(lua_State* L, float value)
+{
+    lua_pushnumber(L, (double)value);
+    return 1;
+}
+
+static inline int lua_set_value_D(lua_State* L, long long value)
+{
+    lua_pushnumber(L, (lua_Number)value);
+    return 1;
+}
+
+static inline int lua_set_value_U(lua_State* L, unsigned long long value)
+{
+    lua_pushnumber(L, (lua_Number)value);
+    return 1;
+}
+
+static inline int lua_set_value_F(lua_State* L, double value)
+{
+    lua_pushnumber(L, value);
+    return 1;
+}
+
+static inline int lua_set_value_s(lua_State* L, const char* value)
+{
+    lua_pushstring(L, value);
+    return 1;
+}
+
+static inline int lua_set_value_p(lua_State* L, const void* value)
+{
+    lua_pushlightuserdata(L, (void*)value);
+    return 1;
+}
+
+static inline int lua_set_value_b(lua_State* L, clua_buffer value)
+{
+    lua_pushlstring(L, value.data, value.len);
+    return 1;
+}
+
+static inline int lua_set_value_B(lua_State* L, clua_bytes* value)
+{
+    if(value == NULL)
+    {
+        lua_pushnil(L);
+        return 1;
+    }
+    memcpy(lua_new_bytes(L, value->len)->data, value->data, value->len);
+    return 1;
+}
+
+/**
+ * @brief 生成数组类型的取值和压栈函数
+ * @param c 类型占位符
+ * @param view 参数类型
+ * @param T 元素类型
+ */
+#define IMPL_CLUA_ARRAY_VALUE(c, view, T)                                                          \
+    static inline view lua_get_value_##c(lua_State* L, int index)                                  \
     {                                                                                              \
-        argret ret = f();                                                                          \
-        if(lua_set_value(L, fmt[0], &ret))                                                         \
+        view value = { NULL, 0 };                                                                  \
+        clua_array* array = lua_to_array(L, index, (#c)[0]);                                       \
+        if(array == NULL)                                                                          \
         {                                                                                          \
-            return 1;                                                                              \
+            lua_get_value_error(L, index, (#c)[0]);                                                \
+            return value;                                                                          \
         }                                                                                          \
-        return 0;                                                                                  \
+        value.data = (T*)array->data;                                                              \
+        value.len = array->len;                                                                    \
+        return value;                                                                              \
+    }                                                                                              \
+                                                                                                   \
+    static inline int lua_set_value_##c(lua_State* L, view value)                                  \
+    {                                                                                              \
+        memcpy(lua_new_array(L, (#c)[0], value.len)->data, value.data, value.len * sizeof(T));     \
+        return 1;                                                                                  \
     }
 
-#define IMPL_CLUA_DEF_RET_1(f, fmt, argret, arg1)                                                  \
-    CLUA_DECL(f)                                                                                   \
+IMPL_CLUA_ARRAY_VALUE(x, clua_floats, float)
+IMPL_CLUA_ARRAY_VALUE(X, clua_doubles, double)
+IMPL_CLUA_ARRAY_VALUE(i, clua_int32s, int32_t)
+IMPL_CLUA_ARRAY_VALUE(I, clua_int64s, int64_t)
+
+/**
+ * @brief 参数类型 x 是否为 CLUA_OUT 标记的输出参数, 即是否带括号
+ */
+#define IMPL_CLUA_IS_OUT(x) IMPL_CLUA_CHECK(IMPL_CLUA_IS_OUT_ x)
+#define IMPL_CLUA_IS_OUT_(...) IMPL_CLUA_PROBE(~)
+#define IMPL_CLUA_UNPAREN(...) __VA_ARGS__
+
+/**
+ * @brief x 为输出参数时展开为 out, 否则展开为 in
+ */
+#define IMPL_CLUA_IF_OUT(x, out, in) IMPL_CLUA_CAT(IMPL_CLUA_IF_OUT_, IMPL_CLUA_IS_OUT(x))(out, in)
+#define IMPL_CLUA_IF_OUT_0(out, in) in
+#define IMPL_CLUA_IF_OUT_1(out, in) out
+
+/**
+ * @brief 参数的值类型, 输出参数 (type) 为 type, 输入参数不变
+ */
+#define IMPL_CLUA_ARG_TYPE(x) IMPL_CLUA_IF_OUT(x, IMPL_CLUA_UNPAREN, ) x
+
+#define IMPL_CLUA_ARG_FMT(c, i, x) &&IMPL_CLUA_FMT_IS(c, i, IMPL_CLUA_ARG_TYPE(x))
+#define IMPL_CLUA_ARG_PARAM(c, i, x) , IMPL_CLUA_ARG_TYPE(x) IMPL_CLUA_IF_OUT(x, *, )
+#define IMPL_CLUA_ARG_PASS(c, i, x) , IMPL_CLUA_IF_OUT(x, &, ) a##i
+
+/**
+ * @brief 输入参数按lua参数顺序取出, 输出参数不占用lua参数, 在C栈上分配并初始化为0
+ */
+#define IMPL_CLUA_ARG_DECL(c, i, x) IMPL_CLUA_IF_OUT(x, IMPL_CLUA_OUT_DECL, IMPL_CLUA_IN_DECL)(i, x)
+#define IMPL_CLUA_IN_DECL(i, x) x a##i = IMPL_CLUA_GET(x, ++impl_clua_n);
+#define IMPL_CLUA_OUT_DECL(i, x) IMPL_CLUA_UNPAREN x a##i = { 0 };
+
+/**
+ * @brief 调用后按顺序压入输出参数
+ */
+#define IMPL_CLUA_ARG_PUSH(c, i, x)                                                                \
+    IMPL_CLUA_IF_OUT(x, IMPL_CLUA_OUT_PUSH, IMPL_CLUA_IN_PUSH)(c, i, x)
+#define IMPL_CLUA_IN_PUSH(fmt, i, x)
+#define IMPL_CLUA_OUT_PUSH(fmt, i, x)                                                              \
+    impl_clua_r += IMPL_CLUA_SET_AS((fmt)[i], IMPL_CLUA_UNPAREN x, a##i);
+
+/**
+ * @brief C函数的实参列表 a1, &a2, ...
+ */
+#define IMPL_CLUA_ARG_LIST(...)                                                                    \
+    IMPL_CLUA_DROP(~IMPL_CLUA_FOREACH(IMPL_CLUA_ARG_PASS, ~, ##__VA_ARGS__))
+
+/**
+ * @brief 压入返回值并返回压入个数, 无返回值时为0
+ */
+#define IMPL_CLUA_RESULT_RET(fmt, type, call) IMPL_CLUA_SET_AS((fmt)[0], type, call)
+#define IMPL_CLUA_RESULT_VOID(fmt, type, call) ((call), 0)
+
+/**
+ * @brief 接口函数体, 取出输入参数后调用 fn, 再依次压入返回值和输出参数
+ * @param cond fmt 第一项的检查结果
+ * @param result IMPL_CLUA_RESULT_RET 或 IMPL_CLUA_RESULT_VOID
+ * @param type 返回值类型
+ */
+#define IMPL_CLUA_BODY(fn, fmt, cond, result, type, ...)                                           \
+    IMPL_CLUA_FMT_ASSERT(fmt, PP_NARG(__VA_ARGS__) + 1,                                            \
+                         cond IMPL_CLUA_FOREACH(IMPL_CLUA_ARG_FMT, fmt, ##__VA_ARGS__));           \
+    int impl_clua_n = 0;                                                                           \
+    (void)impl_clua_n;                                                                             \
+    (void)L;                                                                                       \
+    IMPL_CLUA_FOREACH(IMPL_CLUA_ARG_DECL, ~, ##__VA_ARGS__)                                        \
+    IMPL_CLUA_ARGS_DONE();                                                                         \
+    int impl_clua_r = result(fmt, type, fn(IMPL_CLUA_ARG_LIST(__VA_ARGS__)));                      \
+    IMPL_CLUA_FOREACH(IMPL_CLUA_ARG_PUSH, fmt, ##__VA_ARGS__)                                      \
+    return impl_clua_r
+
+#define IMPL_CLUA_DEF_0(f, fmt, argret, ...)                                                       \
+    IMPL_CLUA_WRAPPER(#f, CLUA_FNAME(f))                                                           \
     {                                                                                              \
-        arg1 a1;                                                                                   \
-        argret ret;                                                                                \
-        if(lua_get_value(L, 1, fmt[1], &a1))                                                       \
-        {                                                                                          \
-            ret = f(a1);                                                                           \
-            return lua_set_value(L, fmt[0], &ret);                                                 \
-        }                                                                                          \
-        return 0;                                                                                  \
+        IMPL_CLUA_BODY(f, fmt, IMPL_CLUA_FMT_IS(fmt, 0, argret), IMPL_CLUA_RESULT_RET, argret,     \
+                       ##__VA_ARGS__);                                                             \
     }
 
-#define IMPL_CLUA_DEF_RET_2(f, fmt, argret, arg1, arg2)                                            \
-    CLUA_DECL(f)                                                                                   \
+#define IMPL_CLUA_DEF_1(f, fmt, _1, _2, ...)                                                       \
+    IMPL_CLUA_WRAPPER(#f, CLUA_FNAME(f))                                                           \
     {                                                                                              \
-        arg1 a1;                                                                                   \
-        arg2 a2;                                                                                   \
-        argret ret;                                                                                \
-        if(lua_get_value(L, 1, fmt[1], &a1) && lua_get_value(L, 2, fmt[2], &a2))                   \
-        {                                                                                          \
-            ret = f(a1, a2);                                                                       \
-            return lua_set_value(L, fmt[0], &ret);                                                 \
-        }                                                                                          \
-        return 0;                                                                                  \
+        IMPL_CLUA_BODY(f, fmt, (fmt)[0] == 'v', IMPL_CLUA_RESULT_VOID, void, ##__VA_ARGS__);       \
     }
 
-#define IMPL_CLUA_DEF_RET_3(f, fmt, argret, arg1, arg2, arg3)                                      \
-    CLUA_DECL(f)                                                                                   \
+/**
+ * @brief 函数指针类型的参数列表, 输出参数为指针, 无参数时为 void
+ */
+#define IMPL_CLUA_SIG_PARAMS(...)                                                                  \
+    IMPL_CLUA_CAT(IMPL_CLUA_SIG_PARAMS_,                                                           \
+                  IMPL_CLUA_CHECK(IMPL_CLUA_CAT(IMPL_CLUA_SIG_NOARGS_, PP_NARG(__VA_ARGS__))))     \
+    (__VA_ARGS__)
+#define IMPL_CLUA_SIG_NOARGS_0 IMPL_CLUA_PROBE(~)
+#define IMPL_CLUA_SIG_PARAMS_0(...)                                                                \
+    IMPL_CLUA_DROP(~IMPL_CLUA_FOREACH(IMPL_CLUA_ARG_PARAM, ~, __VA_ARGS__))
+#define IMPL_CLUA_SIG_PARAMS_1(...) void
+
+/**
+ * @brief 生成跳板函数, 从上值1取出C函数指针后生成与 CLUA_DEF 相同的函数体
+ */
+#define IMPL_CLUA_SIG_WRAPPER(sig, fmt, ret, cond, result, ...)                                    \
+    typedef ret (*CLUA_SIG_TYPE(sig))(IMPL_CLUA_SIG_PARAMS(__VA_ARGS__));                          \
+    IMPL_CLUA_FFI_SIG(sig, fmt, #ret, #__VA_ARGS__)                                                \
+    IMPL_CLUA_WRAPPER(#sig, CLUA_SIG_FNAME(sig))                                                   \
     {                                                                                              \
-        arg1 a1;                                                                                   \
-        arg2 a2;                                                                                   \
-        arg3 a3;                                                                                   \
-        argret ret;                                                                                \
-        if(lua_get_value(L, 1, fmt[1], &a1) && lua_get_value(L, 2, fmt[2], &a2) &&                 \
-           lua_get_value(L, 3, fmt[3], &a3))                                                       \
-        {                                                                                          \
-            ret = f(a1, a2, a3);                                                                   \
-            return lua_set_value(L, fmt[0], &ret);                                                 \
-        }                                                                                          \
-        return 0;                                                                                  \
+        CLUA_SIG_TYPE(sig) fn = (CLUA_SIG_TYPE(sig))lua_touserdata(L, lua_upvalueindex(1));        \
+        IMPL_CLUA_BODY(fn, fmt, cond, result, ret, ##__VA_ARGS__);                                 \
     }
 
-#define IMPL_CLUA_DEF_RET_4(f, fmt, argret, arg1, arg2, arg3, arg4)                                \
-    CLUA_DECL(f)                                                                                   \
+#define IMPL_CLUA_SIG_0(sig, fmt, argret, ...)                                                     \
+    IMPL_CLUA_SIG_WRAPPER(sig, fmt, argret, IMPL_CLUA_FMT_IS(fmt, 0, argret),                      \
+                          IMPL_CLUA_RESULT_RET, ##__VA_ARGS__)
+
+#define IMPL_CLUA_SIG_1(sig, fmt, _1, _2, ...)                                                     \
+    IMPL_CLUA_SIG_WRAPPER(sig, fmt, void, (fmt)[0] == 'v', IMPL_CLUA_RESULT_VOID, ##__VA_ARGS__)
+
+/**
+ * @brief 批量接口中读取第 index 个参数的第 k 个元素, 数组元素会留在栈上直到本次迭代结束.
+ * 转换元素前记录其位置, 出错时报告参数位置和元素序号而不是 -1
+ */
+#define IMPL_CLUA_BATCH_GET(type, index, k, arrays)                                                \
+    (((arrays) & (1 << ((index) - 1)))                                                             \
+         ? (lua_rawgeti(L, index, k), clua_element_current = (clua_element){ index, k, NULL },     \
+            IMPL_CLUA_GET(type, -1))                                                               \
+         : IMPL_CLUA_GET(type, index))
+
+#define IMPL_CLUA_BATCH_DECL(c, i, x)                                                              \
+    x a##i = IMPL_CLUA_BATCH_GET(x, i, k, arrays);                                                 \
+    clua_element_current.index = 0;
+
+/**
+ * @brief 可以按元素展开的参数掩码, 'T' 结构体参数本身是表, 不展开
+ */
+#define IMPL_CLUA_BATCHABLE(c, i, x) | (((c)[i] != 'T') << ((i) - 1))
+#define IMPL_CLUA_BATCH_PREPARE(fmt, ...)                                                          \
+    lua_batch_prepare(L, PP_NARG(__VA_ARGS__),                                                     \
+                      0 IMPL_CLUA_FOREACH(IMPL_CLUA_BATCHABLE, fmt, ##__VA_ARGS__), &n)
+
+/**
+ * @brief 批量接口不支持输出参数
+ */
+#define IMPL_CLUA_DEF_BATCH_0(f, fmt, argret, ...)                                                 \
+    IMPL_CLUA_WRAPPER(#f "_batch", CLUA_BATCH_FNAME(f))                                            \
     {                                                                                              \
-        arg1 a1;                                                                                   \
-        arg2 a2;                                                                                   \
-        arg3 a3;                                                                                   \
-        arg4 a4;                                                                                   \
-        argret ret;                                                                                \
-        if(lua_get_value(L, 1, fmt[1], &a1) && lua_get_value(L, 2, fmt[2], &a2) &&                 \
-           lua_get_value(L, 3, fmt[3], &a3) && lua_get_value(L, 4, fmt[4], &a4))                   \
+        int n;                                                                                     \
+        int arrays = IMPL_CLUA_BATCH_PREPARE(fmt, ##__VA_ARGS__);                                  \
+        lua_createtable(L, n, 0);                                                                  \
+        for(int k = 1; k <= n; ++k)                                                                \
         {                                                                                          \
-            ret = f(a1, a2, a3, a4);                                                               \
-            return lua_set_value(L, fmt[0], &ret);                                                 \
+            IMPL_CLUA_FOREACH(IMPL_CLUA_BATCH_DECL, ~, ##__VA_ARGS__)                              \
+            argret ret = f(IMPL_CLUA_ARG_LIST(__VA_ARGS__));                                       \
+            lua_settop(L, PP_NARG(__VA_ARGS__) + 1);                                               \
+            IMPL_CLUA_SET_AS((fmt)[0], argret, ret);                                               \
+            lua_rawseti(L, -2, k);                                                                 \
         }                                                                                          \
-        return 0;                                                                                  \
+        IMPL_CLUA_ARGS_DONE();                                                                     \
+        return 1;                                                                                  \
     }
 
-#define IMPL_CLUA_DEF_RET_5(f, fmt, argret, arg1, arg2, arg3, arg4, arg5)                          \
-    CLUA_DECL(f)                                                                                   \
+#define IMPL_CLUA_DEF_BATCH_1(f, fmt, _1, _2, ...)                                                 \
+    IMPL_CLUA_WRAPPER(#f "_batch", CLUA_BATCH_FNAME(f))                                            \
     {                                                                                              \
-        arg1 a1;                                                                                   \
-        arg2 a2;                                                                                   \
-        arg3 a3;                                                                                   \
-        arg4 a4;                                                                                   \
-        arg5 a5;                                                                                   \
-        argret ret;                                                                                \
-        if(lua_get_value(L, 1, fmt[1], &a1) && lua_get_value(L, 2, fmt[2], &a2) &&                 \
-           lua_get_value(L, 3, fmt[3], &a3) && lua_get_value(L, 4, fmt[4], &a4) &&                 \
-           lua_get_value(L, 5, fmt[5], &a5))                                                       \
+        int n;                                                                                     \
+        int arrays = IMPL_CLUA_BATCH_PREPARE(fmt, ##__VA_ARGS__);                                  \
+        for(int k = 1; k <= n; ++k)                                                                \
         {                                                                                          \
-            ret = f(a1, a2, a3, a4, a5);                                                           \
-            return lua_set_value(L, fmt[0], &ret);                                                 \
+            IMPL_CLUA_FOREACH(IMPL_CLUA_BATCH_DECL, ~, ##__VA_ARGS__)                              \
+            f(IMPL_CLUA_ARG_LIST(__VA_ARGS__));                                                    \
+            lua_settop(L, PP_NARG(__VA_ARGS__));                                                   \
         }                                                                                          \
+        IMPL_CLUA_ARGS_DONE();                                                                     \
         return 0;                                                                                  \
     }
 
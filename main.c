@@ -1,16 +1,46 @@
+#include "clua_alloc.h"
+#include "clua_async.h"
+#include "clua_cache.h"
+#include "clua_callback.h"
+#include "clua_gc.h"
+#include "clua_pool.h"
 #include "luabinding.h"
+#include <stdlib.h>
 #include <string.h>
+#include <unistd.h>
 
 int add(int a, int b)
 {
     return a+b;
 }
 
+int sub(int a, int b)
+{
+    return a-b;
+}
+
+int mul(int a, int b)
+{
+    return a*b;
+}
+
+int divmod(int a, int b, int* rem)
+{
+    *rem = a%b;
+    return a/b;
+}
+
 int state()
 {
     return 0;
 }
 
+const char* state_name(int s)
+{
+    static const char* const names[] = { "idle", "running", "stopped" };
+    return s >= 0 && s < 3 ? names[s] : "unknown";
+}
+
 int myprint(const char* str)
 {
     return printf("myprint %s\n", str);
@@ -39,30 +69,92 @@ void hello()
     printf("hello\n");
 }
 
-CLUA_DEF(add, "ddd", int, int, int)
+typedef struct counter
+{
+    int value;
+} counter;
+
+counter* counter_new(int start)
+{
+    counter* c = (counter*)malloc(sizeof(counter));
+    c->value = start;
+    return c;
+}
+
+void counter_free(counter* c)
+{
+    printf("counter_free: %d\n", c->value);
+    free(c);
+}
+
+int counter_add(counter* c, int n)
+{
+    return c->value += n;
+}
+
+CLUA_CLASS(counter, counter_free)
+
+#undef CLUA_CLASSES
+#define CLUA_CLASSES(X) X(counter)
+
+int sleep_ms(int ms)
+{
+    usleep((useconds_t)ms * 1000);
+    return ms;
+}
+
+CLUA_DEF_BATCH(add, "ddd", int, int, int)
+CLUA_DEF(divmod, "dddd", int, int, int, CLUA_OUT(int))
 CLUA_DEF(state, "d", int)
+CLUA_DEF(state_name, "Sd", const char*, int)
 CLUA_DEF(myprint, "ds", int, const char*)
-CLUA_DEF(getpoint, "pd", int*, int)
+CLUA_DEF(getpoint, "Pd", int*, int)
 
 CLUA_DEF(myprint2, "vs", VOID, const char*)
 CLUA_DEF(printpoint, "vp", VOID, int*)
 CLUA_DEF(hello, "v", VOID)
+CLUA_DEF(counter_new, "Od", counter*, int)
+CLUA_DEF(counter_add, "dOd", int, counter*, int)
+CLUA_DEF_ASYNC(sleep_ms, "dd", int, int)
+
+CLUA_SIG(ddd, "ddd", int, int, int)
+CLUA_DEF_SIG(sub, ddd)
+CLUA_DEF_SIG(mul, ddd)
 
 static int load_clua(lua_State* L)
 {
-    static luaL_Reg clua_lib[] = {
+    static const clua_reg clua_lib[] = {
         CLUA_REG(add),
+        CLUA_REG_BATCH(add),
+        CLUA_REG(divmod),
         CLUA_REG(state),
+        CLUA_REG(state_name),
         CLUA_REG(myprint),
         CLUA_REG(getpoint),
         CLUA_REG(myprint2),
         CLUA_REG(printpoint),
         CLUA_REG(hello),
+        CLUA_REG(counter_new),
+        CLUA_REG(sleep_ms),
+        CLUA_REG_SIG(sub, ddd),
+        CLUA_REG_SIG(mul, ddd),
 
-        {NULL, NULL}
+        {NULL, NULL, NULL}
     };
 
-    luaL_register(L, "_G", clua_lib);
+    luaopen_clua(L);
+    lua_pop(L, 1);
+    lua_pushvalue(L, LUA_GLOBALSINDEX);
+    lua_register_funcs(L, clua_lib);
+    lua_ffi_bind(L, -1);
+
+    static const luaL_Reg counter_methods[] = {
+        CLUA_METHOD(add, counter_add),
+
+        {NULL, NULL}
+    };
+    lua_register_class(L, &CLUA_CLASS_DESC(counter), counter_methods);
+    lua_pop(L, 1);
     return 1;
 }
 
@@ -71,19 +163,154 @@ static void print_error(lua_State* L)
     fprintf(stderr, "Fatal error: %s\n", lua_tostring(L, -1));
 }
 
-int main()
+/**
+ * @brief 字节码缓存目录, 取自环境变量 CLUA_CACHE_DIR, 未设置时不使用缓存
+ */
+static const char* cache_dir = NULL;
+
+static int load_script(lua_State* L, const char* path)
+{
+    clua_cache_info info;
+    int status = clua_loadfile_cached(L, path, cache_dir, &info);
+    if(cache_dir != NULL)
+    {
+        fprintf(stderr, "load %s: %s %.3f ms\n", path, info.hit ? "cache" : "source",
+                (double)info.ns / 1e6);
+    }
+    return status;
+}
+
+static int run_script(lua_State* L, void* arg)
+{
+    int status = load_script(L, (const char*)arg);
+    if(status != 0)
+        return status;
+    return lua_pcall(L, 0, LUA_MULTRET, 0);
+}
+
+static void init_worker(lua_State* L, void* ud)
+{
+    (void)ud;
+    load_clua(L);
+}
+
+/**
+ * @brief 在线程池中并行执行多个脚本
+ */
+static int run_scripts(int count, char* scripts[], size_t mem_limit)
 {
-    lua_State* L = lua_open();
+    clua_pool* pool = clua_pool_create(0, mem_limit, init_worker, NULL);
+    if(pool == NULL)
+    {
+        fprintf(stderr, "Fatal error: cannot create lua pool\n");
+        return 1;
+    }
+
+    clua_job** jobs = (clua_job**)calloc((size_t)count, sizeof(clua_job*));
+    if(jobs == NULL)
+    {
+        fprintf(stderr, "Fatal error: out of memory\n");
+        clua_pool_destroy(pool);
+        return 1;
+    }
+    for(int i = 0; i < count; ++i)
+    {
+        jobs[i] = clua_pool_submit(pool, run_script, scripts[i], NULL, NULL);
+    }
+
+    int failed = 0;
+    for(int i = 0; i < count; ++i)
+    {
+        if(jobs[i] == NULL || clua_job_wait(jobs[i]) != 0)
+        {
+            fprintf(stderr, "Fatal error: %s: %s\n", scripts[i],
+                    jobs[i] != NULL ? clua_job_error(jobs[i]) : "cannot submit job");
+            failed = 1;
+        }
+        if(jobs[i] != NULL)
+            clua_job_free(jobs[i]);
+    }
+    free(jobs);
+    clua_pool_destroy(pool);
+    return failed;
+}
+
+int main(int argc, char* argv[])
+{
+    cache_dir = getenv("CLUA_CACHE_DIR");
+    /* CLUA_MEM_LIMIT 为每个状态机的内存上限(字节), 未设置时不限制 */
+    const char* limit = getenv("CLUA_MEM_LIMIT");
+    size_t mem_limit = limit != NULL ? strtoull(limit, NULL, 10) : 0;
+    if(argc > 1)
+    {
+        return run_scripts(argc - 1, argv + 1, mem_limit);
+    }
+
+    clua_alloc* alloc = clua_alloc_create(mem_limit, 0);
+    lua_State* L = clua_alloc_newstate(alloc);
+    if(L == NULL && mem_limit == 0)
+    {
+        /* 不支持自定义分配器时, 没有内存上限才可以退回默认分配器 */
+        clua_alloc_destroy(alloc);
+        alloc = NULL;
+        L = luaL_newstate();
+    }
+    if(L == NULL)
+    {
+        fprintf(stderr, "Fatal error: cannot create lua state%s\n",
+                mem_limit != 0 ? " with CLUA_MEM_LIMIT" : "");
+        clua_alloc_destroy(alloc);
+        return 1;
+    }
 
     luaL_openlibs(L);
     load_clua(L);
 
-    int ret = luaL_dofile(L, "/home/hzh/test.lua");
+    /* 脚本在协程中运行, 调用 CLUA_DEF_ASYNC 接口时挂起, 由事件循环恢复 */
+    clua_loop* loop = clua_loop_create(L, 0);
+    int ret = load_script(L, "/home/hzh/test.lua");
+    if(ret == 0)
+        ret = loop != NULL ? clua_loop_spawn(loop, 0) : lua_pcall(L, 0, LUA_MULTRET, 0);
     if(ret != 0)
     {
         print_error(L);
     }
+    if(loop != NULL)
+        clua_loop_run(loop);
+
+    /* 脚本定义了 on_event(id, name) 时, 演示按帧传递事件: 传递期间为关键区, 回收只在帧之间执行 */
+    clua_callback* on_event = clua_callback_global(L, "on_event", "vds");
+    if(on_event != NULL)
+    {
+        clua_gc* gc = clua_gc_create(L);
+        for(int i = 0; i < 3; ++i)
+        {
+            clua_callback_push(on_event, i, "tick");
+            if(gc != NULL)
+                clua_gc_enter(gc);
+            if(clua_callback_flush(on_event) != 0)
+                fprintf(stderr, "Fatal error: %s\n", clua_callback_error(on_event));
+            if(gc != NULL)
+            {
+                clua_gc_leave(gc);
+                clua_gc_tick(gc);
+            }
+        }
+        if(gc != NULL)
+        {
+            clua_gc_stat stat;
+            clua_gc_get_stat(gc, &stat);
+            fprintf(stderr, "gc: %llu cycles, p99 %.3f ms, max %.3f ms, %zu KB, %.1f KB/s\n",
+                    stat.cycles, (double)clua_gc_percentile(&stat, 0.99) / 1e6,
+                    (double)stat.max_ns / 1e6, stat.kbytes, stat.alloc_rate);
+            clua_gc_destroy(gc);
+        }
+        clua_callback_free(on_event);
+    }
+    if(loop != NULL)
+        clua_loop_destroy(loop);
     lua_close(L);
+    clua_alloc_destroy(alloc);
     printf("leave\n");
 
     return 0;